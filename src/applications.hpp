@@ -1,61 +1,78 @@
 #pragma once
+#include "ellipses.hpp"
+#include "ght.hpp"
 #include "gradient.hpp"
 #include "hough.hpp"
 #include "kernel.hpp"
+#include "kht.hpp"
+#include "multithreading.hpp"
+#include "progressive.hpp"
+#include "pyramid.hpp"
+#include "randomized.hpp"
+#include "tiled.hpp"
+#include "twostage.hpp"
 
-struct HoughResult {
-  cv::Mat img, flt, edg, acc, shapes;
-};
-
+// Edge map and direction bins of img, dir_bins is to be passed on to
+// extractEdges. The hysteresis runs on nb_threads bands of rows when
+// nb_threads > 1 (<= 0 : one per core).
 void processGradient(
   const cv::Mat &img,
   cv::Mat & fnl, 
   cv::Mat & dirs,
   int kernel, 
   uchar sh, uchar sb,
-  Dimension dim) 
+  Dimension dim,
+  bool thin = false,
+  int dir_bins = DIR_BINS,
+  int nb_threads = 1) 
 {
-  float* k;
-  switch(kernel) {
-  case 0:
-    k = const_cast<float *>(kernel::prewitt);
-    break; 
-  case 1:
-    k = const_cast<float *>(kernel::sobel);
-    break; 
-  case 2:
-    k = const_cast<float *>(kernel::kirsch);
-    break; 
-  }
-  cv::Mat h(3, 3, CV_32F, k);
+  assert(dir_bins > 0);
+  cv::Mat uc_mags;
+  gradient(img, kernel, uc_mags, dirs, dim, CV_8U, thin, dir_bins);
+  if (nb_threads <= 0)
+    nb_threads = hardwareThreads();
+  if (nb_threads > 1)
+    hysteresisMT(uc_mags, fnl, sh, sb, nb_threads);
+  else
+    hysteresis(uc_mags, fnl, sh, sb);
+}
+
+// Accumulator of the lines and the lines (or segments) drawn into result.
+void drawLineResult(
+  HoughResult & result,
+  cv::Mat const& acc,
+  std::vector<Line> const& lines,
+  std::vector<Segment> const& segments,
+  int thickness,
+  HoughLinesParams const& params)
+{
+  double max;
+  minmax(acc, nullptr, &max);
+  acc.convertTo(result.acc, CV_8UC1, max > 0 ? 255 / max : 0);
+  cv::cvtColor(result.acc, result.acc, cv::COLOR_GRAY2BGR);
 
-  std::vector<cv::Mat> grads;
-  grads = computeGradients(img, h, dim);
+  drawLocalExtrema(lines, result.acc);
 
-  cv::Mat mags, uc_mags;
-  if (dim == Dimension::TWO_DIM) {
-    magnitudeBD(grads, mags, dirs);
+  result.shapes = result.img.clone();
+  if (params.engine == PROGRESSIVE || params.segments) {
+    drawSegments(segments, result.shapes, thickness);
   } else {
-    magnitudeMD(grads, mags, dirs);
+    drawLines(lines, result.shapes, thickness);
   }
-
-  double max;
-  minmax(mags, nullptr, &max);
-  mags.convertTo(uc_mags, CV_8UC1);
-  hysteresis(uc_mags, fnl, sh, sb);
 }
 
-HoughResult houghLinesFromBin(
+// Line detection on an already extracted edge list.
+HoughResult houghLinesFromPoints(
   cv::Mat const& img, 
   cv::Mat const& flt,
   cv::Mat const& edges,
+  EdgePoints const& pts,
   int thickness,
   uchar bin_thresh,
   float line_thresh,
   float grouping_thresh,
   bool use_dirs, 
-  bool canny = false,
-  cv::Mat dirs = cv::Mat()) 
+  HoughLinesParams const& params = HoughLinesParams()) 
 {
   HoughResult result;
   cv::Mat acc;
@@ -63,28 +80,67 @@ HoughResult houghLinesFromBin(
   result.img = img.clone();
   result.flt = flt.clone();
   result.edg = edges.clone();
-  if (canny) {
-    cv::Canny(result.flt, result.edg, 200, 50);
-  }
 
-  if (dirs.empty() || !use_dirs) {
-    houghLines(result.edg, acc, bin_thresh);
+  LineSpace space(pts.cols, pts.rows, params);
+  std::vector<Line> lines;
+  std::vector<Segment> segments;
+  if (params.engine == PROGRESSIVE) {
+    segments = progressiveHoughLines(pts, acc, space, params);
+    for (auto &segment : segments) {
+      lines.push_back(segment.line);
+    }
   } else {
-    houghLines(result.edg, acc, dirs, bin_thresh);
+    if (params.engine == KERNEL) {
+      kernelHoughLines(pts, acc, space, params.cluster_tolerance, params.min_cluster);
+      lines = getLines(acc, space, line_thresh, grouping_thresh, params.peak_radius,
+                       params.top_k, params.threads);
+    } else if (params.pyramid > 0) {
+      lines = pyramidHoughLines(pts, acc, params.pyramid, line_thresh, grouping_thresh,
+                                use_dirs, params);
+    } else {
+      houghLinesMT(params.threads, pts, acc, space, use_dirs, std::max(0.f, params.dir_window));
+      lines = getLines(acc, space, line_thresh, grouping_thresh, params.peak_radius,
+                       params.top_k, params.threads);
+    }
+    if (params.segments) {
+      segments = extractSegments(lines, result.edg, bin_thresh, params.min_length,
+                                 params.max_gap, 1, params.threads);
+    }
   }
 
-  double max;
-  minmax(acc, nullptr, &max);
-  acc.convertTo(result.acc, CV_8UC1, 255 / max);
-  cv::cvtColor(result.acc, result.acc, cv::COLOR_GRAY2BGR);
+  drawLineResult(result, acc, lines, segments, thickness, params);
+  return result;
+}
 
-  auto lines = getLines(acc, line_thresh, grouping_thresh);
-  drawLocalExtrema(lines, result.acc);
+HoughResult houghLinesFromBin(
+  cv::Mat const& img, 
+  cv::Mat const& flt,
+  cv::Mat const& edges,
+  int thickness,
+  uchar bin_thresh,
+  float line_thresh,
+  float grouping_thresh,
+  bool use_dirs, 
+  bool canny = false,
+  cv::Mat dirs = cv::Mat(),
+  HoughLinesParams const& params = HoughLinesParams()) 
+{
+  // edges is only read : Canny and cvtColor write into a fresh Mat
+  cv::Mat edg;
+  if (canny) {
+    cv::Canny(flt, edg, 200, 50);
+  } else if (edges.channels() == 3) {
+    cv::cvtColor(edges, edg, cv::COLOR_BGR2GRAY);
+  } else {
+    edg = edges;
+  }
 
-  result.shapes = result.img.clone();
-  drawLines(lines, result.shapes, thickness);
+  EdgePoints pts;
+  extractEdges(edg, bin_thresh, pts, use_dirs ? dirs : cv::Mat(), cv::Mat(), params.dir_bins);
 
-  return result;
+  return houghLinesFromPoints(
+    img, flt, edg, pts, thickness, bin_thresh, line_thresh, grouping_thresh, use_dirs, params
+  );
 }
 
 HoughResult houghLinesWithGradient(
@@ -97,55 +153,130 @@ HoughResult houghLinesWithGradient(
   float line_thresh,
   float grouping_thresh,
   bool use_dirs,
-  Dimension dim) 
+  Dimension dim,
+  HoughLinesParams const& params = HoughLinesParams()) 
 {
   // Unused because blur var wasn't used anywhere
   // int i = 11;
   // cv::bilateralFilter(img, blur, i, i * 2, i / 2);
+  HoughLinesParams grad_params = params;
+  if (grad_params.dir_window < 0) {
+    grad_params.dir_window = directionTolerance(dim);
+  }
+
+  // edges are binary after hysteresis, bin_thresh 0 keeps every pixel
+  if (params.tiled && params.engine == EXHAUSTIVE && params.pyramid == 0 && bin_thresh > 0) {
+    HoughResult result;
+    result.img = img.clone();
+    result.flt = flt.clone();
+
+    cv::Mat acc;
+    LineSpace space(flt.cols, flt.rows, params);
+    tiledHoughLines(flt, kernel, sh, sb, dim, acc, space, use_dirs,
+                    std::max(0.f, grad_params.dir_window), params, &result.edg);
+    std::vector<Line> lines = getLines(acc, space, line_thresh, grouping_thresh,
+                                       params.peak_radius, params.top_k, params.threads);
+    std::vector<Segment> segments;
+    if (params.segments) {
+      segments = extractSegments(lines, result.edg, bin_thresh, params.min_length,
+                                 params.max_gap, 1, params.threads);
+    }
+    drawLineResult(result, acc, lines, segments, thickness, params);
+    return result;
+  }
+  if (params.tiled) {
+    std::cerr << "Tiled pipeline : exhaustive engine without pyramid and edge threshold > 0 only,"
+                 " staged pipeline used" << std::endl;
+  }
+
   cv::Mat dirs, fnl;
-  processGradient(flt, fnl, dirs, kernel, sh, sb, dim);
+  processGradient(flt, fnl, dirs, kernel, sh, sb, dim, params.thin, params.dir_bins, params.threads);
 
   return houghLinesFromBin(
-    img, flt, fnl, thickness, bin_thresh, line_thresh, grouping_thresh, use_dirs, false, dirs
+    img, flt, fnl, thickness, bin_thresh, line_thresh, grouping_thresh, use_dirs, false, dirs, grad_params
   );
 }
 
-HoughResult houghCirclesFromBin(
+// Circle detection on an already extracted edge list.
+HoughResult houghCirclesFromPoints(
   cv::Mat const& img, 
   cv::Mat const& flt, 
   cv::Mat const& edges,
+  EdgePoints const& pts,
   int thickness,
-  uchar bin_thresh,
   float circle_thresh,
   float grouping_thresh,
-  bool use_dirs, 
-  bool canny = false,
-  cv::Mat dirs = cv::Mat()) 
+  bool use_dirs,
+  HoughCirclesParams const& params = HoughCirclesParams()) 
 {
   HoughResult result;
-  cv::Mat acc;
 
   result.img = img.clone();
   result.flt = flt.clone();
   result.edg = edges.clone();
-  if (canny) {
-    cv::Canny(result.flt, result.edg, 200, 50);
-  }
 
-  if (dirs.empty() || !use_dirs) {
-    houghCircles(result.edg, acc, bin_thresh);
+  std::vector<Circle> circles;
+  // The two stage engine needs directions. Without them nothing is detected,
+  // rather than falling back to the W x H x R cube it exists to avoid.
+  if (params.engine == TWO_STAGE && (!use_dirs || pts.dir.empty())) {
+    std::cerr << "Two stage circle detection needs gradient directions" << std::endl;
+  } else if (params.engine == TWO_STAGE) {
+    cv::Mat acc;
+    circles = twoStageHoughCircles(pts, acc, circle_thresh, params);
+
+    double max;
+    minmax(acc, nullptr, &max);
+    acc.convertTo(result.acc, CV_8UC1, max > 0 ? 255 / max : 0);
+  } else if (params.engine == RANDOMIZED) {
+    circles = randomizedHoughCircles(pts, use_dirs, params);
+  } else if (params.pyramid > 0) {
+    circles = pyramidHoughCircles(pts, params.pyramid, circle_thresh, grouping_thresh,
+                                  use_dirs, params.threads, params.min_radius,
+                                  params.max_radius);
   } else {
-    houghCircles(result.edg, acc, dirs, bin_thresh);
+    cv::Mat acc;
+    int min_r = houghCirclesMT(params.threads, pts, acc, use_dirs, params.min_radius,
+                               params.max_radius, params.voting);
+    circles = getCircles(acc, circle_thresh, grouping_thresh, min_r, params.threads);
   }
 
-  auto circles = getCircles(acc, circle_thresh, grouping_thresh);
-
   result.shapes = result.img.clone();
   drawCircles(circles, result.shapes, thickness);
 
   return result;
 }
 
+HoughResult houghCirclesFromBin(
+  cv::Mat const& img, 
+  cv::Mat const& flt, 
+  cv::Mat const& edges,
+  int thickness,
+  uchar bin_thresh,
+  float circle_thresh,
+  float grouping_thresh,
+  bool use_dirs, 
+  bool canny = false,
+  cv::Mat dirs = cv::Mat(),
+  HoughCirclesParams const& params = HoughCirclesParams()) 
+{
+  // edges is only read : Canny and cvtColor write into a fresh Mat
+  cv::Mat edg;
+  if (canny) {
+    cv::Canny(flt, edg, 200, 50);
+  } else if (edges.channels() == 3) {
+    cv::cvtColor(edges, edg, cv::COLOR_BGR2GRAY);
+  } else {
+    edg = edges;
+  }
+
+  EdgePoints pts;
+  extractEdges(edg, bin_thresh, pts, use_dirs ? dirs : cv::Mat(), cv::Mat(), params.dir_bins);
+
+  return houghCirclesFromPoints(
+    img, flt, edg, pts, thickness, circle_thresh, grouping_thresh, use_dirs, params
+  );
+}
+
 HoughResult houghCirclesWithGradient(
   cv::Mat const& img, 
   cv::Mat const& flt, 
@@ -156,12 +287,180 @@ HoughResult houghCirclesWithGradient(
   float circle_thresh,
   float grouping_thresh,
   bool use_dirs,
-  Dimension dim = MULTI_DIM) 
+  Dimension dim = MULTI_DIM,
+  HoughCirclesParams const& params = HoughCirclesParams()) 
 {
+  if (params.tiled && params.engine == TWO_STAGE && use_dirs && bin_thresh > 0) {
+    HoughResult result;
+    result.img = img.clone();
+    result.flt = flt.clone();
+
+    cv::Mat acc;
+    std::vector<Circle> circles;
+    tiledTwoStageCircles(flt, kernel, sh, sb, dim, acc, circle_thresh, params, circles,
+                         &result.edg);
+
+    double max;
+    minmax(acc, nullptr, &max);
+    acc.convertTo(result.acc, CV_8UC1, max > 0 ? 255 / max : 0);
+
+    result.shapes = result.img.clone();
+    drawCircles(circles, result.shapes, thickness);
+    return result;
+  }
+  if (params.tiled) {
+    std::cerr << "Tiled pipeline : two stage engine with directions and edge threshold > 0 only,"
+                 " staged pipeline used" << std::endl;
+  }
+
   cv::Mat dirs, fnl;
-  processGradient(flt, fnl, dirs, kernel, sh, sb, dim);
+  processGradient(flt, fnl, dirs, kernel, sh, sb, dim, params.thin, params.dir_bins, params.threads);
 
   return houghCirclesFromBin(
-    img, flt, fnl, thickness, bin_thresh, circle_thresh, grouping_thresh, use_dirs, false, dirs
+    img, flt, fnl, thickness, bin_thresh, circle_thresh, grouping_thresh, use_dirs, false, dirs, params
   );
 }
+
+// Ellipse detection on an already extracted edge list, pts must have
+// directions.
+HoughResult houghEllipsesFromPoints(
+  cv::Mat const& img, 
+  cv::Mat const& flt, 
+  cv::Mat const& edges,
+  EdgePoints const& pts,
+  int thickness,
+  float center_thresh,
+  HoughEllipsesParams const& params = HoughEllipsesParams()) 
+{
+  HoughResult result;
+
+  result.img = img.clone();
+  result.flt = flt.clone();
+  result.edg = edges.clone();
+
+  cv::Mat acc;
+  houghEllipseCenters(pts, acc, params.dir_tolerance, params);
+  std::vector<Ellipse> ellipses = getEllipses(acc, pts, center_thresh, params);
+
+  double max;
+  minmax(acc, nullptr, &max);
+  acc.convertTo(result.acc, CV_8UC1, max > 0 ? 255 / max : 0);
+
+  result.shapes = result.img.clone();
+  drawEllipses(ellipses, result.shapes, thickness);
+
+  return result;
+}
+
+HoughResult houghEllipsesWithGradient(
+  cv::Mat const& img, 
+  cv::Mat const& flt, 
+  int kernel, 
+  int thickness,
+  uchar sh, uchar sb, 
+  uchar bin_thresh,
+  float center_thresh,
+  Dimension dim = MULTI_DIM,
+  HoughEllipsesParams const& params = HoughEllipsesParams()) 
+{
+  cv::Mat dirs, fnl;
+  processGradient(flt, fnl, dirs, kernel, sh, sb, dim, params.thin, params.dir_bins, params.threads);
+
+  EdgePoints pts;
+  extractEdges(fnl, bin_thresh, pts, dirs, cv::Mat(), params.dir_bins);
+
+  HoughEllipsesParams grad_params = params;
+  if (grad_params.dir_tolerance < 0) {
+    grad_params.dir_tolerance = directionTolerance(dim);
+  }
+
+  return houghEllipsesFromPoints(img, flt, fnl, pts, thickness, center_thresh, grad_params);
+}
+
+// Template detection on an already extracted edge list, pts must have
+// directions.
+HoughResult houghShapesFromPoints(
+  cv::Mat const& img, 
+  cv::Mat const& flt, 
+  cv::Mat const& edges,
+  EdgePoints const& pts,
+  RTable const& table,
+  int thickness,
+  float shape_thresh,
+  HoughShapesParams const& params = HoughShapesParams()) 
+{
+  HoughResult result;
+
+  result.img = img.clone();
+  result.flt = flt.clone();
+  result.edg = edges.clone();
+
+  cv::Mat acc;
+  PoseTable poses = buildPoseTable(table, params);
+  generalizedHough(pts, table, poses, acc, params.dir_tolerance, params);
+  std::vector<ShapeMatch> matches = getShapes(acc, table, poses, shape_thresh, params);
+
+  // best pose of every cell
+  int rows = acc.rows / poses.size();
+  cv::Mat best = acc.rowRange(0, rows).clone();
+  for (int p = 1; p < poses.size(); ++p) {
+    cv::max(best, acc.rowRange(p * rows, (p + 1) * rows), best);
+  }
+  double max;
+  minmax(best, nullptr, &max);
+  best.convertTo(result.acc, CV_8UC1, max > 0 ? 255 / max : 0);
+
+  result.shapes = result.img.clone();
+  drawShapes(matches, table.outline, result.shapes, thickness);
+
+  return result;
+}
+
+// Edges of tpl, with their directions, as found in the frames.
+EdgePoints templateEdges(
+  cv::Mat const& tpl,
+  int kernel,
+  uchar sh, uchar sb,
+  uchar bin_thresh,
+  Dimension dim,
+  bool thin = false,
+  int dir_bins = DIR_BINS)
+{
+  cv::Mat dirs, fnl;
+  processGradient(tpl, fnl, dirs, kernel, sh, sb, dim, thin, dir_bins);
+
+  EdgePoints pts;
+  extractEdges(fnl, bin_thresh, pts, dirs, cv::Mat(), dir_bins);
+  return pts;
+}
+
+HoughResult houghShapesWithGradient(
+  cv::Mat const& img, 
+  cv::Mat const& flt, 
+  cv::Mat const& tpl_flt, 
+  int kernel, 
+  int thickness,
+  uchar sh, uchar sb, 
+  uchar bin_thresh,
+  float shape_thresh,
+  Dimension dim = MULTI_DIM,
+  HoughShapesParams const& params = HoughShapesParams()) 
+{
+  RTable table = buildRTable(templateEdges(tpl_flt, kernel, sh, sb, bin_thresh, dim, params.thin,
+                                           params.dir_bins),
+                             params.table_bins);
+
+  cv::Mat dirs, fnl;
+  processGradient(flt, fnl, dirs, kernel, sh, sb, dim, params.thin, params.dir_bins, params.threads);
+
+  EdgePoints pts;
+  extractEdges(fnl, bin_thresh, pts, dirs, cv::Mat(), params.dir_bins);
+
+  // the template orientations are as uncertain as the image ones
+  HoughShapesParams grad_params = params;
+  if (grad_params.dir_tolerance < 0) {
+    grad_params.dir_tolerance = 2 * directionTolerance(dim);
+  }
+
+  return houghShapesFromPoints(img, flt, fnl, pts, table, thickness, shape_thresh, grad_params);
+}
@@ -0,0 +1,1456 @@
+#pragma once
+#include "applications.hpp"
+#include "utils.hpp"
+#include <opencv2/imgproc.hpp>
+#include <stack>
+
+// Reference implementations kept to measure the optimized ones against.
+namespace baseline
+{
+  void houghLines(cv::Mat bin, cv::Mat &acc, uchar thresh = 170) {
+    int max_theta = 180;
+    int max_rho = std::ceil(sqrt(bin.cols * bin.cols + bin.rows * bin.rows));
+
+    acc = cv::Mat::zeros(max_theta, 2 * max_rho, CV_32F);
+
+    for (int y = 0; y < bin.rows; y++) {
+      for (int x = 0; x < bin.cols; x++) {
+        if (bin.at<uchar>(y, x) < thresh)
+          continue;
+
+        for (int t = 0; t < max_theta; ++t) {
+          float theta = radians(t);
+          int rho = int(x * cos(theta) + y * sin(theta));
+
+          int r = rho + max_rho;
+
+          acc.at<float>(t, r) += 1.;
+        }
+      }
+    }
+  }
+
+  void houghLines(cv::Mat bin, cv::Mat &acc, cv::Mat &dirs, uchar thresh = 170) {
+    int max_theta = 180;
+    int max_rho = std::ceil(sqrt(bin.cols * bin.cols + bin.rows * bin.rows));
+
+    acc = cv::Mat::zeros(max_theta + 1, 2 * max_rho, CV_32F);
+
+    for (int y = 0; y < bin.rows; y++) {
+      for (int x = 0; x < bin.cols; x++) {
+        if (bin.at<uchar>(y, x) < thresh)
+          continue;
+
+        float theta = dirs.at<float>(y, x);
+
+        if (theta < 0)
+          theta = radians(180) + theta;
+        else if (theta > radians(180))
+          theta = theta - radians(180);
+
+        int rho = int(x * cos(theta) + y * sin(theta));
+
+        int r = rho + max_rho;
+        acc.at<float>(degrees(theta), r) += 1.;
+      }
+    }
+  }
+
+  void colorPixelRegion(cv::Mat &bin, std::stack<cv::Point> &stack, int thresh,
+                        unsigned int x, unsigned int y) {
+    unsigned int rows = bin.rows;
+    unsigned int cols = bin.cols;
+    bin.at<float>(y, x) = 0;
+
+    int px = x, py = y;
+    std::vector<cv::Point> neighbors = {
+        {px - 1, py}, {px + 1, py}, {px, py - 1}, {px, py + 1}};
+    for (auto neigh : neighbors) {
+      if (withinMat(neigh.x, neigh.y, cols, rows)) {
+        if (bin.at<float>(neigh.y, neigh.x) > thresh) {
+          bin.at<float>(neigh.y, neigh.x) = 0;
+          stack.push({neigh.x, neigh.y});
+        }
+      }
+    }
+  }
+
+  std::vector<Line> getLines(const cv::Mat &bin, LineSpace const &space,
+                             float th1 = 0.4f, float th2 = 0.05f) {
+    cv::Mat tmp = bin.clone();
+
+    std::vector<Line> lines;
+
+    double max;
+    cv::Point empty;
+    cv::minMaxLoc(bin, nullptr, &max);
+
+    for (int y = 0; y < tmp.rows; y++) {
+      for (int x = 0; x < tmp.cols; x++) {
+        if (tmp.at<float>(y, x) < th1 * max)
+          continue;
+        std::stack<cv::Point> stack;
+        stack.push({x, y});
+        Line line;
+        cv::Point2f barycenter = {0.f, 0.f};
+        int count = 0;
+
+        while (!stack.empty()) {
+          cv::Point p = stack.top();
+          stack.pop();
+
+          barycenter += cv::Point2f(p.x, p.y);
+
+          colorPixelRegion(tmp, stack, th2 * max, p.x, p.y);
+
+          ++count;
+        }
+
+        barycenter /= count;
+        line.theta = space.theta(barycenter.y);
+        line.rho = space.rho(barycenter.x);
+        line.position_in_acc = {int(barycenter.x), int(barycenter.y)};
+        lines.push_back(line);
+      }
+    }
+
+    return lines;
+  }
+
+  void max3DMat(cv::Mat const& mat, double& max)
+  {
+    assert(mat.dims == 3);
+    int aSize = mat.size[1];
+    int bSize = mat.size[0];
+    int rSize = mat.size[2];
+
+    max = 0;
+    for (int a = 0; a < aSize; ++a) {
+      for (int b = 0; b < bSize; ++b) {
+        for (int r = 0; r < rSize; ++r) {
+          if (mat.at<float>(b,a,r) > max) {
+            max = mat.at<float>(b,a,r);
+          }
+        }
+      }
+    }
+  }
+
+  void colorPixel3DRegion(
+    cv::Mat &bin, std::stack<cv::Point3f> &stack, int thresh, int a, int b, int r
+  ) {
+    assert(bin.dims == 3);
+    int aSize = bin.size[1];
+    int bSize = bin.size[0];
+    int rSize = bin.size[2];
+    bin.at<float>(b,a,r) = 0;
+
+    std::vector<cv::Point3f> neighbors = {
+        cv::Point3f(a - 1, b, r), cv::Point3f(a + 1, b, r),
+        cv::Point3f(a, b - 1, r), cv::Point3f(a, b + 1, r),
+        cv::Point3f(a, b, r - 1), cv::Point3f(a, b, r + 1)
+    };
+    for (auto neigh : neighbors) {
+      if (within3DMat(neigh.x, neigh.y, neigh.z, aSize, bSize, rSize)) {
+        if (bin.at<float>(neigh.y, neigh.x, neigh.z) > thresh) {
+          bin.at<float>(neigh.y, neigh.x, neigh.z) = 0;
+          stack.push({neigh.x, neigh.y, neigh.z});
+        }
+      }
+    }
+  }
+
+
+  // min_radius is the radius of the first slice of the accumulator.
+  std::vector<Circle> getCircles(
+    const cv::Mat &bin, float circle_thresh, float grouping_thresh, int min_radius = 1
+  ) {
+    assert(bin.dims == 3);
+    int aSize = bin.size[1];
+    int bSize = bin.size[0];
+    int rSize = bin.size[2];
+
+    cv::Mat tmp = bin.clone();
+
+    std::vector<Circle> circles;
+
+    double max;
+    max3DMat(bin, max);
+
+    for (int b = 0; b < bSize; b++) {
+      for (int a = 0; a < aSize; a++) {
+        for (int r = 0; r < rSize; r++) {
+          if (tmp.at<float>(b,a,r) < circle_thresh*max)
+            continue;
+          std::stack<cv::Point3f> stack;
+
+          stack.push(cv::Point3f(a, b, r));
+          Circle circle;
+          cv::Point3f barycenter = {0.f, 0.f, 0.f};
+          int count = 0;
+
+          while (!stack.empty()) {
+            cv::Point3f p = stack.top();
+            stack.pop();
+
+            barycenter += cv::Point3f(a, b, r);
+
+            colorPixel3DRegion(tmp, stack, grouping_thresh*max, p.x, p.y, p.z);
+
+            ++count;
+          }
+
+          barycenter /= count;
+          circle.radius = barycenter.z + min_radius;
+          circle.center = {int(barycenter.x), int(barycenter.y)};
+          circles.push_back(circle);
+        }
+      }
+    }
+
+    return circles;
+  }
+
+  // Hysteresis in one forward pass : a weak pixel is kept if one of 3 of its
+  // neighbours (below and to the right) is already an edge.
+  bool checkNeighbors(cv::Mat const& img, unsigned int r, unsigned int c) 
+  {
+      for (int i = -1; i < 1; ++i) {
+          for (int j = -1; j < 1; ++j) {
+              if (i == 0 && j == 0) continue;
+              if (img.at<uchar>(r-i,c-j) > 0) 
+                  return true;
+          }
+      }
+
+      return false;
+  }
+
+  void hysteresis(cv::Mat const& src, cv::Mat & dest, uchar sh, uchar sb) 
+  {
+      assert(src.type() == CV_8UC1);
+      dest = cv::Mat::zeros(src.size(), src.type());
+      int rows = src.rows;
+      int cols = src.cols;
+
+      // Premier parcours
+      for (int r = 1; r < rows-1; ++r) {
+          for (int c = 1; c < cols-1; ++c) {
+              if (src.at<uchar>(r, c) > sh) {
+                  dest.at<uchar>(r, c) = 255;
+              }
+          }
+      }
+
+      // Second parcour
+      for (int r = 1; r < rows-1; ++r) {
+          for (int c = 1; c < cols-1; ++c) {
+              uchar val = src.at<uchar>(r, c);
+              if (val <= sh && val > sb) {
+                  if (checkNeighbors(dest, r, c)) {
+                      dest.at<uchar>(r, c) = 255;
+                  }
+              }
+          }
+      }
+  }
+
+  // Gradient with one full image per oriented kernel, read back by the
+  // magnitude pass. h is square of any odd size with two directions; with
+  // four, 3x3 : only its border can be turned by 45 degrees.
+  std::vector<cv::Mat> computeGradients(const cv::Mat& src, const cv::Mat& h, Dimension dim=MULTI_DIM)
+  {
+      assert(h.rows == h.cols && h.rows % 2 == 1);
+      assert(dim == TWO_DIM || h.rows == 3);
+      int height = src.rows;
+      int width = src.cols;
+      int radius = h.rows / 2;
+
+      std::vector<cv::Mat> krns(dim);
+      krns[0] = h;
+      for (int i = 1; i < dim; ++i) {
+          krns[i] = dim == 2 ? kernel::rotate90(krns[i-1]) : kernel::rotate(krns[i-1]);
+      }
+
+      std::vector<cv::Mat> grads(dim);
+      for (int k = 0; k < dim; ++k) {
+          grads[k] = cv::Mat::zeros(src.size(), CV_32F);
+      }
+
+      for (int r = radius; r < height - radius; ++r) {
+          for (int c = radius; c < width - radius; ++c) {
+              for (int k = 0; k < dim; ++k) {
+                  float val = convolution(src, krns[k], c, r);
+                  grads[k].at<float>(r, c) = val;
+              }
+          }
+      }
+
+      return grads;
+  }
+
+  // 3x3 filter, per pixel, the one pixel frame left at zero.
+  void filter(const cv::Mat &src, cv::Mat &dst, const cv::Mat &h) {
+    assert(h.rows == 3 && h.cols == 3);
+    int height = src.rows;
+    int width = src.cols;
+    dst = cv::Mat::zeros(src.size(), src.type());
+
+    for (int r = 1; r < height - 1; ++r) {
+      for (int c = 1; c < width - 1; ++c) {
+        dst.at<uchar>(r, c) = cv::saturate_cast<uchar>(convolution(src, h, c, r));
+      }
+    }
+  }
+
+  // Point operations, per pixel through at<>.
+  cv::Mat etirement(const cv::Mat &image, int Nmin, int Nmax) {
+    cv::Mat image2(image.rows, image.cols, CV_8UC1);
+    for (int r = 0; r < image.rows; ++r) {
+      for (int c = 0; c < image.cols; ++c) {
+        image2.at<uchar>(r, c) =
+            cv::saturate_cast<uchar>(255 * ((image.at<uchar>(r, c) - Nmin) /
+                                            static_cast<double>(Nmax - Nmin)));
+      }
+    }
+    return image2;
+  }
+
+  cv::Mat egalisation(const cv::Mat &inputImage, const cv::Mat &inputHist, int histSize) {
+    cv::Mat histoCumul = calcHistCumul(inputHist, histSize);
+    histoCumul /= inputImage.total();
+    cv::Mat outputImage = inputImage.clone();
+    for (int i = 0; i < outputImage.rows; ++i) {
+      for (int j = 0; j < outputImage.cols; ++j) {
+        outputImage.at<uchar>(i, j) = cv::saturate_cast<uchar>(
+            255 * histoCumul.at<float>(inputImage.at<uchar>(i, j)));
+      }
+    }
+    return outputImage;
+  }
+
+  void thresholding(cv::Mat const &src, cv::Mat &dst, uchar ths) {
+    dst = src.clone();
+    for (int r = 1; r < src.rows - 1; ++r) {
+      for (int c = 1; c < src.cols - 1; ++c) {
+        dst.at<uchar>(r, c) = src.at<uchar>(r, c) < ths ? 0 : 255;
+      }
+    }
+  }
+
+  void intersectImg(cv::Mat const &bin, cv::Mat const &lns, cv::Mat &dst) {
+    dst = lns.clone();
+    for (int r = 0; r < bin.rows; ++r) {
+      for (int c = 0; c < bin.cols; ++c) {
+        if (dst.at<uchar>(r, c) != 255)
+          continue;
+        dst.at<uchar>(r, c) = (bin.at<uchar>(r, c) == 255) ? 255 : 0;
+      }
+    }
+  }
+
+  // Fused gradient reading the coefficients of the oriented kernels at
+  // runtime, with CV_8U magnitudes and CV_32F directions.
+  template <int dim>
+  void fusedGradientRow(const uchar* p0, const uchar* p1, const uchar* p2, const float (*h)[9],
+                        int cols, float* mag, float* dir, float* gx, float* gy)
+  {
+      for (int c = 1; c < cols - 1; ++c) {
+          float n[9] = {
+              float(p0[c - 1]), float(p0[c]), float(p0[c + 1]),
+              float(p1[c - 1]), float(p1[c]), float(p1[c + 1]),
+              float(p2[c - 1]), float(p2[c]), float(p2[c + 1])
+          };
+          float g[dim];
+          for (int k = 0; k < dim; ++k) {
+              float sum = 0.0;
+              for (int t = 0; t < 9; ++t) {
+                  sum += h[k][t] * n[t];
+              }
+              g[k] = sum;
+          }
+
+          if (dim == TWO_DIM) {
+              gx[c] = g[0];
+              gy[c] = g[1];
+          } else {
+              float sup = abs(g[0]);
+              float d = 0.f;
+              for (int k = 1; k < dim; ++k) {
+                  float tmp = abs(g[k]);
+                  d = tmp > sup ? k : d;
+                  sup = tmp > sup ? tmp : sup;
+              }
+              mag[c] = sup;
+              dir[c] = d*M_PI_4;
+          }
+      }
+
+      if (dim == TWO_DIM) {
+          for (int c = 1; c < cols - 1; ++c) {
+              mag[c] = sqrt(gx[c]*gx[c]+gy[c]*gy[c]);
+              dir[c] = atan2(gy[c], gx[c]);
+          }
+      }
+  }
+
+  void fusedGradient(const cv::Mat& src, const cv::Mat& h, cv::Mat& mags, cv::Mat& dirs,
+                     Dimension dim = MULTI_DIM)
+  {
+      float krn[MULTI_DIM][9];
+      cv::Mat rt = h;
+      for (int k = 0; k < dim; ++k) {
+          if (k > 0) {
+              rt = kernel::rotate(rt);
+              if (dim == 2) {
+                  rt = kernel::rotate(rt);
+              }
+          }
+          for (int t = 0; t < 9; ++t) {
+              krn[k][t] = rt.at<float>(t / 3, t % 3);
+          }
+      }
+      mags = cv::Mat::zeros(src.size(), CV_8U);
+      dirs = cv::Mat::zeros(src.size(), CV_32F);
+
+      std::vector<float> buf(3 * src.cols, 0.f);
+      float* gx = buf.data();
+      float* gy = gx + src.cols;
+      float* mag = gy + src.cols;
+      for (int r = 1; r < src.rows - 1; ++r) {
+          const uchar* p0 = src.ptr<uchar>(r - 1);
+          const uchar* p1 = src.ptr<uchar>(r);
+          const uchar* p2 = src.ptr<uchar>(r + 1);
+          if (dim == TWO_DIM) {
+              fusedGradientRow<TWO_DIM>(p0, p1, p2, krn, src.cols, mag, dirs.ptr<float>(r), gx, gy);
+          } else {
+              fusedGradientRow<MULTI_DIM>(p0, p1, p2, krn, src.cols, mag, dirs.ptr<float>(r), gx, gy);
+          }
+          uchar* out = mags.ptr<uchar>(r);
+          for (int c = 1; c < src.cols - 1; ++c) {
+              out[c] = cv::saturate_cast<uchar>(mag[c]);
+          }
+      }
+  }
+
+  void magnitudeBD(std::vector<cv::Mat> const& grads, cv::Mat & mags, cv::Mat & dirs)
+  {
+      mags = cv::Mat::zeros(grads[0].size(), CV_32F);
+      dirs = cv::Mat::zeros(grads[0].size(), CV_32F);
+      int rows = grads[0].rows;
+      int cols = grads[0].cols;
+      for (int r = 1; r < rows-1; ++r) {
+          for (int c = 1; c < cols-1; ++c) {
+              float gx = grads[0].at<float>(r, c);
+              float gy = grads[1].at<float>(r, c);
+              float mag = sqrt(gx*gx+gy*gy);
+              float dir = atan2(gy, gx);
+
+              mags.at<float>(r, c) = mag;
+              dirs.at<float>(r, c) = dir;
+          }
+      }
+  }
+
+  void magnitudeMD(std::vector<cv::Mat> const& grads, cv::Mat & mags, cv::Mat & dirs)
+  {
+      mags = cv::Mat::zeros(grads[0].size(), CV_32F);
+      dirs = cv::Mat::zeros(grads[0].size(), CV_32F);
+      int rows = grads[0].rows;
+      int cols = grads[0].cols;
+      for (int r = 1; r < rows-1; ++r) {
+          for (int c = 1; c < cols-1; ++c) {
+              float sup = abs(grads[0].at<float>(r, c));
+              float dir = 0.f;
+              for (int k = 1; k < grads.size(); ++k) {
+                  float tmp = abs(grads[k].at<float>(r, c));
+                  if (tmp > sup) {
+                      sup = tmp;
+                      dir = k;
+                  }
+              }
+              float val = sup;
+              mags.at<float>(r, c) = val;
+              dirs.at<float>(r, c) = dir*M_PI_4;
+          }
+      }
+  }
+
+  // Voters reading float directions, with their trigonometry per edge.
+  void voteLinesDirs(cv::Mat &acc, LineSpace const &space, const int *xs,
+                     const int *ys, const float *thetas, int n, int window = 0) {
+    float offset = space.rho_offset + 0.5f;
+    for (int i = 0; i < n; ++i) {
+      int t0 = thetaBin(thetas[i], space);
+      for (int dt = -window; dt <= window; ++dt) {
+        int t = (t0 + dt + space.n_theta) % space.n_theta;
+        int r = int(xs[i] * space.trig->cos_t[t] + ys[i] * space.trig->sin_t[t] + offset);
+        acc.at<float>(t, r) += 1.;
+      }
+    }
+  }
+
+  void voteCenters(cv::Mat &acc, EdgePoints const &pts, const float *dirs,
+                   int min_r, int max_r) {
+    for (int i = 0; i < pts.size(); ++i) {
+      float c = cos(dirs[i]);
+      float s = sin(dirs[i]);
+      for (int dir : {1, -1}) {
+        for (int r = min_r; r <= max_r; ++r) {
+          int a = pts.x[i] + dir * r * c;
+          int b = pts.y[i] + dir * r * s;
+          if (!withinMat(a, b, acc.cols, acc.rows))
+            break;
+          acc.at<float>(b, a) += 1;
+        }
+      }
+    }
+  }
+}
+
+// Mean duration of func over a few runs, in milliseconds.
+double benchmark(std::function<void()> func, int repeats = 5) {
+  TimeFunction timer;
+  long long total = 0;
+  for (int i = 0; i < repeats; ++i) {
+    timer(func);
+    total += timer.microseconds;
+  }
+  return total / 1000.0 / repeats;
+}
+
+void report(std::string name, double ms, double reference_ms = 0) {
+  std::cout << "  " << name << " : " << ms << " ms";
+  if (reference_ms > 0) {
+    std::cout << " (x" << reference_ms / ms << ")";
+  }
+  std::cout << std::endl;
+}
+
+// Edges and directions of an image with the default demo settings.
+void benchEdges(const cv::Mat &img, cv::Mat &edges, cv::Mat &dirs,
+                Dimension dim = MULTI_DIM, bool thin = false) {
+  cv::Mat gray, flt;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  cv::bilateralFilter(gray, flt, 9, 27, 27);
+  processGradient(flt, edges, dirs, 2, 24, 4, dim, thin);
+}
+
+void benchEdgeExtraction(const cv::Mat &img) {
+  cv::Mat edges, dirs;
+  benchEdges(img, edges, dirs);
+  EdgePoints pts;
+  double ms = benchmark([&]() { extractEdges(edges, 255, pts, dirs); });
+  std::cout << "Edge extraction (" << pts.size() << " edges, "
+            << 100.0 * pts.size() / edges.total() << "% of the image)" << std::endl;
+  report("extractEdges", ms);
+}
+
+void benchGradient(const cv::Mat &img) {
+  cv::Mat gray, flt;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  cv::bilateralFilter(gray, flt, 9, 27, 27);
+  std::cout << "Gradient (" << flt.cols << "x" << flt.rows << ")" << std::endl;
+
+  for (int k = 0; k < (int)std::size(kernel::GRADIENTS); ++k) {
+    cv::Mat h(3, 3, CV_32F, const_cast<float *>(kernel::GRADIENTS[k]));
+    for (Dimension dim : {TWO_DIM, MULTI_DIM}) {
+      std::string label = std::string(kernel::GRADIENT_NAMES[k]) +
+                          (dim == TWO_DIM ? ", 2 directions" : ", 4 directions");
+      cv::Mat mags, ref_mags, dirs, ref_dirs;
+      double ref = benchmark([&]() {
+        auto grads = baseline::computeGradients(flt, h, dim);
+        if (dim == TWO_DIM) {
+          baseline::magnitudeBD(grads, mags, ref_dirs);
+        } else {
+          baseline::magnitudeMD(grads, mags, ref_dirs);
+        }
+        mags.convertTo(ref_mags, CV_8UC1);
+      });
+      report(label + ", per kernel images", ref);
+
+      auto difference = [&]() {
+        return ", max difference " + std::to_string(cv::norm(mags, ref_mags, cv::NORM_INF)) +
+               " / " + std::to_string(cv::norm(dirs, ref_dirs, cv::NORM_INF)) + " rad";
+      };
+      double ms = benchmark([&]() { baseline::fusedGradient(flt, h, mags, dirs, dim); });
+      report(label + ", fused, runtime coefficients" + difference(), ms, ref);
+      ms = benchmark([&]() { gradient(flt, k, mags, dirs, dim, CV_8U, false, 0); });
+      report(label + ", fused, specialized" + difference(), ms, ref);
+    }
+  }
+}
+
+void benchConvolution(const cv::Mat &img) {
+  cv::Mat gray;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  std::cout << "Convolution (" << gray.cols << "x" << gray.rows << ")" << std::endl;
+
+  cv::Mat dst, ref_dst;
+  cv::Mat h3(3, 3, CV_32F, const_cast<float *>(kernel::gaussian));
+  double ref = benchmark([&]() { baseline::filter(gray, ref_dst, h3); });
+  report("gaussian 3x3, per pixel", ref);
+  double ms = benchmark([&]() { filter(gray, dst, h3); });
+  report("gaussian 3x3, separable", ms, ref);
+
+  for (int size : {3, 5, 7}) {
+    std::vector<float> g = kernel::gaussian1D(size, (size - 1) / 4.f);
+    cv::Mat h(size, size, CV_32F);
+    for (int r = 0; r < size; ++r) {
+      for (int c = 0; c < size; ++c) {
+        h.at<float>(r, c) = g[r] * g[c];
+      }
+    }
+    std::string label = "gaussian " + std::to_string(size) + "x" + std::to_string(size);
+    cv::Mat direct(gray.size(), CV_32F), separable;
+    ref = benchmark([&]() { filter2DRows(gray, direct, h, 0, gray.rows); });
+    report(label + ", 2D, one thread", ref);
+    ms = benchmark([&]() { sepFilter(gray, separable, {g, g}, 1); });
+    report(label + ", separable, one thread, max difference " +
+           std::to_string(cv::norm(direct, separable, cv::NORM_INF)), ms, ref);
+    ms = benchmark([&]() { sepFilter(gray, separable, {g, g}); });
+    report(label + ", separable, all cores", ms, ref);
+  }
+
+  // The larger derivatives of Gaussian smooth enough to replace the
+  // bilateral pre-pass of the demos.
+  std::cout << "Edges (sh 24, sb 4)" << std::endl;
+  ref = 0;
+  for (int k = 0; k < kernel::GRADIENT_COUNT; ++k) {
+    bool prepass = kernel::GRADIENT_SIZES[k] == 3;
+    cv::Mat flt, edges, dirs;
+    ms = benchmark([&]() {
+      if (prepass) {
+        cv::bilateralFilter(gray, flt, 9, 27, 27);
+      } else {
+        flt = gray;
+      }
+      processGradient(flt, edges, dirs, k, 24, 4, TWO_DIM);
+    });
+    report(std::string(kernel::GRADIENT_NAMES[k]) + (prepass ? " + bilateral" : "") + ", " +
+           std::to_string(cv::countNonZero(edges)) + " edges", ms, ref);
+    if (k == kernel::KIRSCH)
+      ref = ms;
+  }
+}
+
+void benchHysteresis(const cv::Mat &img) {
+  cv::Mat gray, flt, mags, dirs;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  cv::bilateralFilter(gray, flt, 9, 27, 27);
+  gradient(flt, kernel::KIRSCH, mags, dirs, MULTI_DIM, CV_8U);
+  std::cout << "Hysteresis (" << mags.cols << "x" << mags.rows << ", sh 24, sb 4)" << std::endl;
+
+  cv::Mat ref_edges, edges;
+  double ref = benchmark([&]() { baseline::hysteresis(mags, ref_edges, 24, 4); });
+  report("one pass, " + std::to_string(cv::countNonZero(ref_edges)) + " edges", ref);
+  double ms = benchmark([&]() { hysteresis(mags, edges, 24, 4); });
+  report("worklist, " + std::to_string(cv::countNonZero(edges)) + " edges", ms, ref);
+
+  for (int threads : {1, 0}) {
+    cv::Mat mt_edges;
+    ms = benchmark([&]() { hysteresisMT(mags, mt_edges, 24, 4, threads); });
+    report(std::string("union-find, ") + (threads ? "1 thread" : "all cores") +
+           (cv::norm(mt_edges, edges, cv::NORM_INF) == 0 ? ", same edges" : ", DIFFERENT edges"),
+           ms, ref);
+  }
+}
+
+void benchThinning(const cv::Mat &img) {
+  cv::Mat gray, flt;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  cv::bilateralFilter(gray, flt, 9, 27, 27);
+  std::cout << "Edge thinning (" << flt.cols << "x" << flt.rows << ")" << std::endl;
+
+  for (Dimension dim : {MULTI_DIM, TWO_DIM}) {
+    double ref_votes = 0;
+    for (bool thin : {false, true}) {
+      cv::Mat edges, dirs, acc;
+      double grad = benchmark([&]() { processGradient(flt, edges, dirs, 2, 24, 4, dim, thin); });
+      EdgePoints pts;
+      extractEdges(edges, 255, pts, dirs);
+
+      HoughLinesParams params;
+      LineSpace space(pts.cols, pts.rows, params);
+      double lines = benchmark([&]() { houghLines(pts, acc, space); });
+      HoughCirclesParams circle_params;
+      circle_params.threads = 1;
+      double circles = benchmark([&]() { twoStageHoughCircles(pts, acc, 0.8f, circle_params); });
+
+      std::string label = std::string(dim == TWO_DIM ? "2 directions" : "4 directions") +
+                          (thin ? ", thinned" : "") + ", " + std::to_string(pts.size()) + " edges";
+      report(label + ", gradient", grad);
+      report(label + ", line voting", lines, thin ? ref_votes : 0);
+      report(label + ", two stage circles", circles);
+      if (!thin)
+        ref_votes = lines;
+    }
+  }
+}
+
+void benchDirections(const cv::Mat &img) {
+  cv::Mat gray, flt;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  cv::bilateralFilter(gray, flt, 9, 27, 27);
+  std::cout << "Direction maps (" << flt.cols << "x" << flt.rows << ")" << std::endl;
+
+  float max_error = 0;
+  for (int i = 0; i < 100000; ++i) {
+    float x = (i % 317) - 158.f, y = (i / 317) - 158.f;
+    float ref = atan2(y, x);
+    ref = ref < 0 ? ref + 2 * M_PI : ref;
+    float error = std::abs(fastAtan2(y, x) - ref);
+    max_error = std::max(max_error, std::min(error, float(2 * M_PI) - error));
+  }
+  std::cout << "  fastAtan2 max error : " << degrees(max_error) << " deg" << std::endl;
+
+  for (Dimension dim : {TWO_DIM, MULTI_DIM}) {
+    std::string label = dim == TWO_DIM ? "2 directions" : "4 directions";
+    cv::Mat mags, dirs;
+    double ref = benchmark([&]() {
+      gradient(flt, kernel::SOBEL, mags, dirs, dim, CV_8U, false, 0);
+    });
+    report(label + ", float radians, dirs " + std::to_string(dirs.total() * dirs.elemSize() / 1024) +
+           " KB", ref);
+    for (int nb_bins : {64, 128, 256}) {
+      double ms = benchmark([&]() {
+        gradient(flt, kernel::SOBEL, mags, dirs, dim, CV_8U, false, nb_bins);
+      });
+      report(label + ", " + std::to_string(nb_bins) + " bins, dirs " +
+             std::to_string(dirs.total() * dirs.elemSize() / 1024) + " KB", ms, ref);
+    }
+  }
+
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs, TWO_DIM);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+  std::vector<float> thetas;
+  for (uchar d : pts.dir) {
+    thetas.push_back(pts.bins().angle[d]);
+  }
+  std::cout << "Voting with directions (" << pts.size() << " edges)" << std::endl;
+
+  HoughLinesParams params;
+  LineSpace space(pts.cols, pts.rows, params);
+  int window = windowBins(directionTolerance(TWO_DIM), space);
+  double ref = benchmark([&]() {
+    acc = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+    baseline::voteLinesDirs(acc, space, pts.x.data(), pts.y.data(), thetas.data(), pts.size(),
+                            window);
+  });
+  report("lines, float directions", ref);
+  double ms = benchmark([&]() {
+    acc = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+    voteLinesDirs(acc, space, pts.x.data(), pts.y.data(), pts.dir.data(), pts.bins(),
+                  pts.size(), window);
+  });
+  report("lines, direction bins", ms, ref);
+
+  int min_r, max_r;
+  circleRange(pts, true, 1, 0, min_r, max_r);
+  ref = benchmark([&]() {
+    acc = cv::Mat::zeros(pts.rows, pts.cols, CV_32F);
+    baseline::voteCenters(acc, pts, thetas.data(), min_r, max_r);
+  });
+  report("circle centers, float directions", ref);
+  ms = benchmark([&]() {
+    acc = cv::Mat::zeros(pts.rows, pts.cols, CV_32F);
+    voteCenters(acc, pts, 0, pts.size(), min_r, max_r);
+  });
+  report("circle centers, direction bins", ms, ref);
+}
+
+void benchLineVoting(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  std::cout << "Line voting (" << cv::countNonZero(edges) << " edges)" << std::endl;
+
+  double ref = benchmark([&]() { baseline::houghLines(edges, acc, 255); });
+  report("baseline", ref);
+
+  for (float theta_step : {1.f, 0.5f, 2.f}) {
+    HoughLinesParams params;
+    params.theta_step = theta_step;
+    LineSpace space(edges.cols, edges.rows, params);
+    double ms = benchmark([&]() { houghLines(edges, acc, space, 255); });
+    report("table, theta step " + std::to_string(theta_step), ms, ref);
+  }
+
+  cv::Mat angles = directionAngles(dirs);
+  ref = benchmark([&]() { baseline::houghLines(edges, acc, angles, 255); });
+  report("baseline with dirs", ref);
+  LineSpace space(edges.cols, edges.rows, HoughLinesParams());
+  double ms = benchmark([&]() { houghLines(edges, acc, dirs, space, 255); });
+  report("table with dirs", ms, ref);
+}
+
+void benchLineThreads(const cv::Mat &img) {
+  cv::Mat edges, dirs, ref_acc, acc;
+  benchEdges(img, edges, dirs);
+  std::cout << "Parallel line voting (" << cv::countNonZero(edges) << " edges)" << std::endl;
+
+  LineSpace space(edges.cols, edges.rows, HoughLinesParams());
+  double ref = benchmark([&]() { houghLinesMT(1, edges, ref_acc, space, 255); });
+  report("1 thread", ref);
+
+  for (int threads = 2; threads <= 2 * hardwareThreads(); threads *= 2) {
+    double ms = benchmark([&]() { houghLinesMT(threads, edges, acc, space, 255); });
+    bool identical = cv::norm(acc, ref_acc, cv::NORM_INF) == 0;
+    report(std::to_string(threads) + " threads" + (identical ? "" : " (MISMATCH)"), ms, ref);
+  }
+}
+
+void benchCircleThreads(const cv::Mat &img) {
+  cv::Mat small, edges, dirs, ref_acc, acc;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+
+  for (bool use_dirs : {false, true}) {
+    std::cout << "Parallel circle voting, " << (use_dirs ? "directions" : "all centers")
+              << " (" << small.cols << "x" << small.rows << ", " << pts.size() << " edges)"
+              << std::endl;
+    double ref = benchmark([&]() { houghCirclesMT(1, pts, ref_acc, use_dirs, 1, 100); }, 1);
+    report("1 thread, a mutex per cell would take " +
+           std::to_string(ref_acc.total() * sizeof(std::mutex) >> 20) + " MB", ref);
+
+    for (int threads = 2; threads <= 2 * hardwareThreads(); threads *= 2) {
+      double ms = benchmark([&]() { houghCirclesMT(threads, pts, acc, use_dirs, 1, 100); }, 1);
+      bool identical = cv::norm(acc, ref_acc, cv::NORM_INF) == 0;
+      report(std::to_string(threads) + " threads" + (identical ? "" : " (MISMATCH)"), ms, ref);
+    }
+  }
+}
+
+void benchProgressive(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts);
+
+  HoughLinesParams params;
+  LineSpace space(pts.cols, pts.rows, params);
+  std::cout << "Progressive line detection (" << pts.size() << " edges)" << std::endl;
+
+  double ref = benchmark([&]() {
+    houghLines(pts, acc, space);
+    getLines(acc, space);
+  });
+  report("exhaustive, " + std::to_string((long long)pts.size() * space.n_theta) + " votes", ref);
+
+  long long votes = 0;
+  std::vector<Segment> segments;
+  double ms = benchmark([&]() {
+    segments = progressiveHoughLines(pts, acc, space, params, &votes);
+  });
+  report("progressive, " + std::to_string(votes) + " votes, " +
+         std::to_string(segments.size()) + " segments", ms, ref);
+}
+
+// Fraction of the reference lines found within the tolerances.
+double recall(std::vector<Line> const &reference, std::vector<Line> const &found,
+              float theta_tol = radians(3), float rho_tol = 5) {
+  if (reference.empty())
+    return 1;
+
+  int matched = 0;
+  for (auto &ref : reference) {
+    for (auto &line : found) {
+      float dt = std::abs(ref.theta - line.theta);
+      float dr = std::abs(ref.rho - line.rho);
+      // theta close to 0 and 180 : same line, opposite rho
+      if (dt > M_PI_2) {
+        dt = M_PI - dt;
+        dr = std::abs(ref.rho + line.rho);
+      }
+      if (dt <= theta_tol && dr <= rho_tol) {
+        ++matched;
+        break;
+      }
+    }
+  }
+  return double(matched) / reference.size();
+}
+
+void benchDirWindow(const cv::Mat &img) {
+  for (Dimension dim : {MULTI_DIM, TWO_DIM}) {
+    cv::Mat edges, dirs, acc;
+    benchEdges(img, edges, dirs, dim);
+    EdgePoints pts;
+    extractEdges(edges, 255, pts, dirs);
+    LineSpace space(pts.cols, pts.rows, HoughLinesParams());
+
+    std::cout << "Direction window voting, " << (dim == MULTI_DIM ? "multi" : "bi")
+              << "directional gradient (" << pts.size() << " edges)" << std::endl;
+
+    houghLines(pts, acc, space);
+    auto reference = getLines(acc, space);
+
+    auto run = [&](std::string name, bool use_dirs, float window, double ref_ms) {
+      double ms = benchmark([&]() { houghLines(pts, acc, space, use_dirs, window); });
+      auto lines = getLines(acc, space);
+      int bins = use_dirs ? 2 * windowBins(window, space) + 1 : space.n_theta;
+      double votes = double(pts.size()) * bins / (ms / 1000.0);
+      report(name + ", " + std::to_string(int(votes / 1e6)) + " Mvotes/s, recall " +
+             std::to_string(recall(reference, lines)), ms, ref_ms);
+      return ms;
+    };
+
+    double ref = run("all theta bins", false, 0, 0);
+    run("single vote", true, 0, ref);
+    for (float window : {directionTolerance(dim), 10.f, 30.f}) {
+      run("window +/-" + std::to_string(window) + " deg", true, window, ref);
+    }
+  }
+}
+
+void benchLinePeaks(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  LineSpace space(edges.cols, edges.rows, HoughLinesParams());
+  houghLines(edges, acc, space, 255);
+
+  for (float th1 : {0.4f, 0.1f, 0.02f}) {
+    std::vector<Line> lines;
+    std::cout << "Line peaks, threshold " << th1 << std::endl;
+    double ref = benchmark([&]() { lines = baseline::getLines(acc, space, th1, th1 / 2); });
+    report("flood fill, " + std::to_string(lines.size()) + " lines", ref);
+    double ms = benchmark([&]() { lines = getLines(acc, space, th1, th1 / 2); });
+    report("non-maximum suppression, " + std::to_string(lines.size()) + " lines", ms, ref);
+    ms = benchmark([&]() { lines = getLines(acc, space, th1, th1 / 2, 2, 0, 0); });
+    report("non-maximum suppression, all cores", ms, ref);
+    ms = benchmark([&]() { lines = getLines(acc, space, th1, th1 / 2, 2, 20, 0); });
+    report("non-maximum suppression, top 20, all cores", ms, ref);
+  }
+}
+
+void benchSegments(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  LineSpace space(edges.cols, edges.rows, HoughLinesParams());
+  houghLines(edges, acc, space, 255);
+  auto lines = getLines(acc, space, 0.3f, 0.1f);
+  std::cout << "Segment extraction (" << lines.size() << " lines)" << std::endl;
+
+  double ref = benchmark([&]() {
+    cv::Mat mask = cv::Mat::zeros(edges.size(), CV_8UC3), gray, lns, dst;
+    drawLines(lines, mask, 1);
+    cv::cvtColor(mask, gray, cv::COLOR_BGR2GRAY);
+    thresholding(gray, lns, 1);
+    intersectImg(edges, lns, dst);
+  });
+  report("line mask and intersectImg", ref);
+
+  std::vector<Segment> segments;
+  double ms = benchmark([&]() { segments = extractSegments(lines, edges, 255, 30, 5, 1, 1); });
+  report("extractSegments, " + std::to_string(segments.size()) + " segments", ms, ref);
+  ms = benchmark([&]() { segments = extractSegments(lines, edges, 255, 30, 5, 1, 0); });
+  report("extractSegments, all cores", ms, ref);
+}
+
+// Circles of reference matched by a found circle within tol pixels (center
+// and radius), and the mean error of the matches.
+void matchCircles(std::vector<Circle> const &reference, std::vector<Circle> const &found,
+                  int &matched, double &error, float tol = 5) {
+  matched = 0;
+  error = 0;
+  for (auto &ref : reference) {
+    for (auto &circle : found) {
+      cv::Point d = circle.center - ref.center;
+      double e = std::hypot(d.x, d.y) + std::abs(circle.radius - ref.radius);
+      if (e <= tol) {
+        ++matched;
+        error += e;
+        break;
+      }
+    }
+  }
+  if (matched)
+    error /= matched;
+}
+
+void benchPyramid(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+  HoughLinesParams params;
+  LineSpace space(pts.cols, pts.rows, params);
+
+  std::cout << "Pyramid line detection (" << pts.size() << " edges)" << std::endl;
+  std::vector<Line> reference, lines;
+  double ref = benchmark([&]() {
+    houghLinesMT(0, pts, acc, space);
+    reference = getLines(acc, space, 0.4f, 0.05f, 2, 0, 0);
+  });
+  report("full resolution, " + std::to_string(reference.size()) + " lines", ref);
+  for (int levels : {1, 2}) {
+    double ms = benchmark([&]() {
+      lines = pyramidHoughLines(pts, acc, levels, 0.4f, 0.05f, false, params);
+    });
+    report(std::to_string(1 << levels) + "x downsampled, recall " +
+           std::to_string(recall(reference, lines, radians(1), 2)), ms, ref);
+  }
+
+  // The full resolution circle cube is only affordable on a thumbnail.
+  cv::Mat small;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  extractEdges(edges, 255, pts, dirs);
+
+  std::cout << "Pyramid circle detection (" << small.cols << "x" << small.rows << ", "
+            << pts.size() << " edges)" << std::endl;
+  std::vector<Circle> ref_circles, circles;
+  ref = benchmark([&]() {
+    houghCircles(pts, acc, true);
+    ref_circles = getCircles(acc, 0.8f, 0.5f);
+  }, 1);
+  report("full resolution, " + std::to_string(ref_circles.size()) + " circles", ref);
+  for (int levels : {1, 2}) {
+    double ms = benchmark([&]() {
+      circles = pyramidHoughCircles(pts, levels, 0.8f, 0.5f, true);
+    }, 1);
+    int matched;
+    double error;
+    matchCircles(ref_circles, circles, matched, error);
+    report(std::to_string(1 << levels) + "x downsampled, " + std::to_string(matched) +
+           " matched, mean error " + std::to_string(error) + " px", ms, ref);
+  }
+}
+
+void benchCircleRadius(const cv::Mat &img) {
+  // The unbounded cube is only affordable on a thumbnail.
+  cv::Mat small, edges, dirs, acc;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+
+  std::cout << "Radius-bounded circle accumulator (" << small.cols << "x" << small.rows
+            << ", " << pts.size() << " edges)" << std::endl;
+  auto megabytes = [&]() { return std::to_string(acc.total() * acc.elemSize() >> 20) + " MB"; };
+  for (bool use_dirs : {false, true}) {
+    std::string name = use_dirs ? "directions, " : "all centers, ";
+    double ref = benchmark([&]() { houghCircles(pts, acc, use_dirs); }, 1);
+    report(name + "all radii, " + megabytes(), ref);
+    for (int max_r : {100, 50, 25}) {
+      double ms = benchmark([&]() { houghCircles(pts, acc, use_dirs, max_r / 2, max_r); }, 1);
+      report(name + "radii " + std::to_string(max_r / 2) + "-" + std::to_string(max_r) +
+             ", " + megabytes(), ms, ref);
+    }
+  }
+}
+
+void benchCircleRaster(const cv::Mat &img) {
+  cv::Mat small, edges, dirs, acc;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts);
+
+  std::cout << "Rasterized circle voting (" << small.cols << "x" << small.rows << ", "
+            << pts.size() << " edges)" << std::endl;
+  for (int max_r : {25, 100, 0}) {
+    std::string range = max_r ? "radii 1-" + std::to_string(max_r) : "all radii";
+    std::vector<Circle> reference, circles;
+    double ref = benchmark([&]() {
+      int min_r = houghCircles(pts, acc, false, 1, max_r);
+      reference = getCircles(acc, 0.8f, 0.5f, min_r);
+    }, 1);
+    report(range + ", sweep, " + std::to_string(reference.size()) + " circles", ref);
+
+    for (int threads : {1, 0}) {
+      double ms = benchmark([&]() {
+        int min_r = houghCirclesMT(threads, pts, acc, false, 1, max_r, RASTER);
+        circles = getCircles(acc, 0.8f, 0.5f, min_r);
+      }, 1);
+      int matched;
+      double error;
+      matchCircles(reference, circles, matched, error);
+      report(range + ", raster, " + (threads ? "1 thread, " : "all cores, ") +
+             std::to_string(matched) + " matched", ms, ref);
+    }
+  }
+}
+
+void benchCirclePeaks(const cv::Mat &img) {
+  cv::Mat small, edges, dirs, acc;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+  int min_r = houghCirclesMT(0, pts, acc, true);
+
+  std::cout << "Circle peaks (" << acc.size[0] << "x" << acc.size[1] << "x" << acc.size[2]
+            << " accumulator)" << std::endl;
+  for (float th1 : {0.8f, 0.5f, 0.2f}) {
+    std::vector<Circle> reference, circles;
+    std::cout << "Circle peaks, threshold " << th1 << std::endl;
+    double ref = benchmark([&]() { reference = baseline::getCircles(acc, th1, th1 / 2, min_r); }, 1);
+    report("flood fill, " + std::to_string(reference.size()) + " circles", ref);
+    for (int threads : {1, 0}) {
+      double ms = benchmark([&]() { circles = getCircles(acc, th1, th1 / 2, min_r, threads); });
+      int matched;
+      double error;
+      matchCircles(reference, circles, matched, error);
+      report(std::string("non-maximum suppression, ") + (threads ? "1 thread, " : "all cores, ") +
+             std::to_string(circles.size()) + " circles, " + std::to_string(matched) + " matched",
+             ms, ref);
+    }
+  }
+}
+
+void benchTwoStage(const cv::Mat &img) {
+  // The cube is only affordable on a thumbnail.
+  cv::Mat small, edges, dirs, acc;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+
+  std::cout << "Two-stage circle detection (" << small.cols << "x" << small.rows << ", "
+            << pts.size() << " edges)" << std::endl;
+  HoughCirclesParams params;
+  std::vector<Circle> reference, circles;
+  double ref = benchmark([&]() {
+    int min_r = houghCircles(pts, acc, true);
+    reference = getCircles(acc, 0.8f, 0.5f, min_r);
+  }, 1);
+  report("3D accumulator, " + std::to_string(acc.total() * acc.elemSize() >> 20) + " MB, " +
+         std::to_string(reference.size()) + " circles", ref);
+  for (int threads : {1, 0}) {
+    params.threads = threads;
+    double ms = benchmark([&]() {
+      circles = twoStageHoughCircles(pts, acc, 0.8f, params);
+    });
+    int matched;
+    double error;
+    matchCircles(reference, circles, matched, error);
+    report(std::string("two stage, ") + (threads ? "1 thread, " : "all cores, ") +
+           std::to_string(acc.total() * acc.elemSize() >> 20) + " MB, " +
+           std::to_string(matched) + " matched", ms, ref);
+  }
+}
+
+void benchRandomized(const cv::Mat &img) {
+  // The cube is only affordable on a thumbnail.
+  cv::Mat small, edges, dirs, acc;
+  float scale = std::min(1.f, 400.f / img.cols);
+  cv::resize(img, small, cv::Size(img.cols * scale, img.rows * scale));
+  benchEdges(small, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+
+  std::cout << "Randomized circle detection (" << small.cols << "x" << small.rows << ", "
+            << pts.size() << " edges)" << std::endl;
+  std::vector<Circle> reference, circles;
+  double ref = benchmark([&]() {
+    int min_r = houghCirclesMT(0, pts, acc, true);
+    reference = getCircles(acc, 0.8f, 0.5f, min_r, 0);
+  }, 1);
+  report("3D accumulator, " + std::to_string(reference.size()) + " circles", ref);
+
+  HoughCirclesParams params;
+  for (bool use_dirs : {false, true}) {
+    for (int iterations : {5000, 20000, 100000}) {
+      params.iterations = iterations;
+      long long samples = 0;
+      double ms = benchmark([&]() {
+        circles = randomizedHoughCircles(pts, use_dirs, params, &samples);
+      });
+      int matched;
+      double error;
+      matchCircles(reference, circles, matched, error);
+      report(std::string("randomized, ") + (use_dirs ? "pairs, " : "triples, ") +
+             std::to_string(samples) + " samples, " + std::to_string(circles.size()) +
+             " circles, " + std::to_string(matched) + " matched", ms, ref);
+    }
+  }
+}
+
+void benchEllipses(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts, dirs);
+
+  std::cout << "Ellipse detection (" << pts.size() << " edges)" << std::endl;
+  HoughEllipsesParams params;
+  float tolerance = directionTolerance(MULTI_DIM);
+  double ref = 0;
+  if (pts.size() > 100000) {
+    // quadratic in the edges, minutes past this size
+    std::cout << "  center voting, all pairs : skipped" << std::endl;
+  } else {
+    // worst case : MULTI_DIM has 4 orientations, every partner of a bucket
+    HoughEllipsesParams all = params;
+    all.threads = 1;
+    all.max_pairs = 0;
+    long long pairs = 0;
+    ref = benchmark([&]() {
+      houghEllipseCenters(pts, acc, tolerance, all, &pairs);
+    });
+    report("center voting, 1 thread, all " + std::to_string(pairs) + " pairs", ref);
+  }
+  for (int threads : {1, 0}) {
+    params.threads = threads;
+    long long pairs = 0;
+    double ms = benchmark([&]() {
+      houghEllipseCenters(pts, acc, tolerance, params, &pairs);
+    });
+    report(std::string("center voting, ") + (threads ? "1 thread, " : "all cores, ") +
+           std::to_string(pairs) + " sampled pairs", ms, ref);
+  }
+  std::vector<Ellipse> ellipses;
+  double ms = benchmark([&]() {
+    ellipses = getEllipses(acc, pts, 0.5f, params);
+  });
+  report("axes and orientation, " + std::to_string(ellipses.size()) + " ellipses", ms);
+}
+
+void benchShapes(const cv::Mat &img) {
+  // The template is the middle of the frame, so it's found at least once.
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  EdgePoints pts, tpl;
+  extractEdges(edges, 255, pts, dirs);
+  cv::Rect middle(img.cols / 3, img.rows / 3, img.cols / 3, img.rows / 3);
+  extractEdges(edges(middle).clone(), 255, tpl, dirs(middle).clone());
+
+  HoughShapesParams params;
+  params.min_angle = -30;
+  params.max_angle = 30;
+  params.min_scale = 0.9f;
+  params.max_scale = 1.1f;
+  RTable table = buildRTable(tpl, params.table_bins);
+  PoseTable poses = buildPoseTable(table, params);
+  std::cout << "Generalized Hough (" << pts.size() << " edges, " << tpl.size()
+            << " template edges, " << poses.size() << " poses)" << std::endl;
+
+  // 180 degrees on each side : every edge reads the whole R-table
+  float tolerance = 2 * directionTolerance(MULTI_DIM);
+  params.threads = 1;
+  double ref = benchmark([&]() {
+    generalizedHough(pts, table, poses, acc, 180, params);
+  }, 1);
+  report("all bins, 1 thread", ref);
+  for (int threads : {1, 0}) {
+    params.threads = threads;
+    double ms = benchmark([&]() {
+      generalizedHough(pts, table, poses, acc, tolerance, params);
+    });
+    report(std::string("bucketed +/-") + std::to_string(cvRound(tolerance)) + " deg, " +
+           (threads ? "1 thread" : "all cores"), ms, ref);
+  }
+  std::vector<ShapeMatch> matches;
+  double ms = benchmark([&]() {
+    matches = getShapes(acc, table, poses, 0.5f, params);
+  });
+  report("peaks, " + std::to_string(matches.size()) + " matches, " +
+         std::to_string(acc.total() * acc.elemSize() >> 20) + " MB", ms);
+}
+
+void benchKernel(const cv::Mat &img) {
+  cv::Mat edges, dirs, acc;
+  benchEdges(img, edges, dirs);
+  EdgePoints pts;
+  extractEdges(edges, 255, pts);
+  HoughLinesParams params;
+  LineSpace space(pts.cols, pts.rows, params);
+
+  std::cout << "Kernel line detection (" << pts.size() << " edges)" << std::endl;
+  std::vector<Line> reference, lines;
+  double ref = benchmark([&]() {
+    houghLines(pts, acc, space);
+    reference = getLines(acc, space, 0.4f, 0.05f);
+  });
+  report("exhaustive, " + std::to_string((long long)pts.size() * space.n_theta) +
+         " votes, " + std::to_string(reference.size()) + " lines", ref);
+  double ms = benchmark([&]() {
+    houghLinesMT(0, pts, acc, space);
+    getLines(acc, space, 0.4f, 0.05f, 2, 0, 0);
+  });
+  report("exhaustive, all cores", ms, ref);
+
+  for (float tolerance : {1.f, 1.5f, 3.f}) {
+    int clusters = 0;
+    ms = benchmark([&]() {
+      kernelHoughLines(pts, acc, space, tolerance, params.min_cluster, &clusters);
+      lines = getLines(acc, space, 0.4f, 0.05f);
+    });
+    report("kernel, tolerance " + std::to_string(tolerance) + ", " +
+           std::to_string(clusters) + " clusters, recall " +
+           std::to_string(recall(reference, lines, radians(2), 3)), ms, ref);
+  }
+}
+
+// The staged path keeps full images of the gradient (tilePixelBytes per
+// pixel without the source), the hysteresis map, the edge list and the
+// accumulators ; the tiled one only the bands in flight.
+void benchTiled(const cv::Mat &img) {
+  cv::Mat gray, flt;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  cv::bilateralFilter(gray, flt, 9, 27, 27);
+  std::cout << "Tiled pipeline (" << flt.cols << "x" << flt.rows << ", sh 24, sb 4, "
+            << (TILE_BYTES >> 10) << " KB bands)" << std::endl;
+  auto kb = [](size_t bytes) { return std::to_string(bytes >> 10) + " KB"; };
+  size_t pixels = flt.total();
+
+  HoughLinesParams line_params;
+  LineSpace space(flt.cols, flt.rows, line_params);
+  float window = directionTolerance(MULTI_DIM);
+  size_t acc_bytes = size_t(space.n_theta) * space.n_rho * sizeof(float);
+  for (int k : {kernel::KIRSCH, kernel::DOG7}) {
+    std::string name = std::string(kernel::GRADIENT_NAMES[k]) + " lines";
+    cv::Mat fnl, dirs, ref_acc, acc, edges;
+    EdgePoints pts;
+    double ref = benchmark([&]() {
+      processGradient(flt, fnl, dirs, k, 24, 4, MULTI_DIM);
+      extractEdges(fnl, 255, pts, dirs);
+      houghLinesMT(line_params.threads, pts, ref_acc, space, true, window);
+    });
+    size_t staged = pixels * tilePixelBytes(k) + pts.size() * (2 * sizeof(int) + 1) +
+                    lineWorkers(line_params.threads, pts.size()) * acc_bytes;
+    report(name + ", staged, " + kb(staged), ref);
+
+    for (int threads : {1, 0}) {
+      line_params.threads = threads;
+      TileStats stats;
+      double ms = benchmark([&]() {
+        stats = tiledHoughLines(flt, k, 24, 4, MULTI_DIM, acc, space, true, window,
+                                line_params, &edges);
+      });
+      bool same = cv::norm(edges, fnl, cv::NORM_INF) == 0 &&
+                  cv::norm(acc, ref_acc, cv::NORM_INF) == 0;
+      report(name + ", tiled, " + (threads ? "1 thread, " : "all cores, ") +
+             std::to_string(stats.bands) + " bands of " + std::to_string(stats.band_rows) +
+             " rows, " + kb(stats.peak_bytes) +
+             (same ? ", same edges and accumulator" : ", DIFFERENT edges or accumulator"),
+             ms, ref);
+    }
+    line_params.threads = 0;
+  }
+
+  HoughCirclesParams circle_params;
+  circle_params.engine = TWO_STAGE;
+  circle_params.max_radius = 100;
+  cv::Mat fnl, dirs, ref_acc, acc;
+  EdgePoints pts;
+  std::vector<Circle> reference, circles;
+  double ref = benchmark([&]() {
+    processGradient(flt, fnl, dirs, kernel::KIRSCH, 24, 4, MULTI_DIM);
+    extractEdges(fnl, 255, pts, dirs);
+    reference = twoStageHoughCircles(pts, ref_acc, 0.8f, circle_params);
+  }, 1);
+  size_t staged = pixels * tilePixelBytes(kernel::KIRSCH) + pts.size() * (2 * sizeof(int) + 1) +
+                  lineWorkers(circle_params.threads, pts.size()) * pixels * sizeof(float);
+  report("kirsch two stage circles up to 100 pixels, staged, " + kb(staged), ref);
+  TileStats stats;
+  double ms = benchmark([&]() {
+    stats = tiledTwoStageCircles(flt, kernel::KIRSCH, 24, 4, MULTI_DIM, acc, 0.8f,
+                                 circle_params, circles);
+  }, 1);
+  int matched;
+  double error;
+  matchCircles(reference, circles, matched, error);
+  report("kirsch two stage circles up to 100 pixels, tiled, " + kb(stats.peak_bytes) + ", " +
+         std::to_string(matched) + "/" + std::to_string(reference.size()) + " matched", ms, ref);
+}
+
+// Each point operation against its per pixel version, on one thread and on
+// all cores.
+void benchPointOps(const cv::Mat &img) {
+  cv::Mat gray, edges, dirs;
+  cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+  benchEdges(img, edges, dirs);
+  std::cout << "Point operations (" << gray.cols << "x" << gray.rows << ")" << std::endl;
+
+  int channels[] = {0}, hist_size = 256;
+  float range[] = {0, 256};
+  const float *ranges[] = {range};
+  cv::Mat hist;
+  cv::calcHist(&gray, 1, channels, cv::Mat(), hist, 1, &hist_size, ranges);
+
+  cv::Mat lns;
+  baseline::thresholding(gray, lns, 128);
+  cv::Mat h3(3, 3, CV_32F, const_cast<float *>(kernel::gaussian));
+  cv::Rect inside(1, 1, gray.cols - 2, gray.rows - 2);
+
+  // name, per pixel version, new version on nb_threads, compared area
+  struct PointOp {
+    std::string name;
+    std::function<void(cv::Mat &)> ref;
+    std::function<void(cv::Mat &, int)> op;
+    cv::Rect area;
+  };
+  cv::Rect all(0, 0, gray.cols, gray.rows);
+  std::vector<PointOp> ops = {
+    {"thresholding", [&](cv::Mat &dst) { baseline::thresholding(gray, dst, 128); },
+     [&](cv::Mat &dst, int t) { thresholding(gray, dst, 128, t); }, all},
+    {"etirement", [&](cv::Mat &dst) { dst = baseline::etirement(gray, 40, 200); },
+     [&](cv::Mat &dst, int t) { dst = etirement(gray, 40, 200, t); }, all},
+    {"egalisation", [&](cv::Mat &dst) { dst = baseline::egalisation(gray, hist, hist_size); },
+     [&](cv::Mat &dst, int t) { dst = egalisation(gray, hist, hist_size, t); }, all},
+    {"intersectImg", [&](cv::Mat &dst) { baseline::intersectImg(edges, lns, dst); },
+     [&](cv::Mat &dst, int t) { intersectImg(edges, lns, dst, t); }, all},
+    // borders differ : the per pixel filter leaves the frame at zero
+    {"filter 3x3", [&](cv::Mat &dst) { baseline::filter(gray, dst, h3); },
+     [&](cv::Mat &dst, int t) { filter(gray, dst, h3, t); }, inside},
+  };
+
+  for (auto &op : ops) {
+    cv::Mat ref_dst, dst;
+    double ref = benchmark([&]() { op.ref(ref_dst); });
+    report(op.name + ", per pixel", ref);
+    for (int threads : {1, 0}) {
+      double ms = benchmark([&]() { op.op(dst, threads); });
+      double diff = cv::norm(dst(op.area), ref_dst(op.area), cv::NORM_INF);
+      report(op.name + (threads ? ", rows, 1 thread" : ", rows, all cores") +
+             ", max difference " + std::to_string(int(diff)), ms, ref);
+    }
+  }
+}
+
+int runBenchmarks(const cv::Mat &img, std::string name = "") {
+  std::map<std::string, std::function<void(const cv::Mat &)>> benches = {
+    {"circle_peaks", benchCirclePeaks},
+    {"circle_radius", benchCircleRadius},
+    {"circles_mt", benchCircleThreads},
+    {"circle_raster", benchCircleRaster},
+    {"convolution", benchConvolution},
+    {"directions", benchDirections},
+    {"dir_window", benchDirWindow},
+    {"edges", benchEdgeExtraction},
+    {"ellipses", benchEllipses},
+    {"gradient", benchGradient},
+    {"hysteresis", benchHysteresis},
+    {"kernel", benchKernel},
+    {"lines", benchLineVoting},
+    {"lines_mt", benchLineThreads},
+    {"line_peaks", benchLinePeaks},
+    {"point_ops", benchPointOps},
+    {"progressive", benchProgressive},
+    {"randomized", benchRandomized},
+    {"pyramid", benchPyramid},
+    {"segments", benchSegments},
+    {"shapes", benchShapes},
+    {"thinning", benchThinning},
+    {"tiled", benchTiled},
+    {"two_stage", benchTwoStage},
+  };
+
+  for (auto &[bench_name, bench] : benches) {
+    if (name.empty() || name == bench_name) {
+      bench(img);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include "kernel.hpp"
+#include "utils.hpp"
+
+// Correlation of images by kernels of any odd size, as the gradients use
+// them (no flip). Separable kernels are applied as a pass along the rows
+// then one along the columns : 2n products per pixel instead of n^2. Each
+// pass is a sum of shifted rows, which vectorizes. Borders are reflected
+// without repeating the edge pixel (dcb|abcd|cba), so the result covers the
+// whole image.
+
+// Index i reflected into [0, n).
+inline int reflect101(int i, int n) {
+  if (n == 1)
+    return 0;
+  while (i < 0 || i >= n) {
+    i = i < 0 ? -i : 2 * n - 2 - i;
+  }
+  return i;
+}
+
+// Row y of src (CV_8UC1 or CV_32F) as floats, with pad reflected pixels on
+// each side.
+void paddedRow(const cv::Mat &src, int y, int pad, float *out) {
+  int cols = src.cols;
+  if (src.type() == CV_8UC1) {
+    const uchar *in = src.ptr<uchar>(y);
+    for (int c = 0; c < cols; ++c) {
+      out[pad + c] = in[c];
+    }
+  } else {
+    const float *in = src.ptr<float>(y);
+    std::copy(in, in + cols, out + pad);
+  }
+  for (int i = 1; i <= pad; ++i) {
+    out[pad - i] = out[pad + reflect101(-i, cols)];
+    out[pad + cols - 1 + i] = out[pad + reflect101(cols - 1 + i, cols)];
+  }
+}
+
+// out[c] = sum k[i] in[c + i] for c in [0, cols) : one shifted row per tap,
+// zero taps skipped.
+void rowPass(const float *in, std::vector<float> const &k, int cols, float *out) {
+  std::fill(out, out + cols, 0.f);
+  for (size_t i = 0; i < k.size(); ++i) {
+    float w = k[i];
+    if (w == 0.f)
+      continue;
+    for (int c = 0; c < cols; ++c) {
+      out[c] += w * in[c + i];
+    }
+  }
+}
+
+// Rows [first, last) of dst (CV_32F) : src correlated by k. The row pass
+// is done on the rows of the band and the ones its column pass reads.
+void sepFilterRows(const cv::Mat &src, cv::Mat &dst, kernel::Separable const &k,
+                   int first, int last) {
+  int cols = src.cols;
+  int rx = k.row.size() / 2, ry = k.col.size() / 2;
+  int n = last - first + 2 * ry;
+  std::vector<float> padded(cols + 2 * rx), tmp(n * cols);
+  for (int i = 0; i < n; ++i) {
+    paddedRow(src, reflect101(first - ry + i, src.rows), rx, padded.data());
+    rowPass(padded.data(), k.row, cols, &tmp[i * cols]);
+  }
+
+  for (int r = first; r < last; ++r) {
+    float *out = dst.ptr<float>(r);
+    std::fill(out, out + cols, 0.f);
+    for (int j = 0; j < (int)k.col.size(); ++j) {
+      float w = k.col[j];
+      if (w == 0.f)
+        continue;
+      const float *in = &tmp[(r - first + j) * cols];
+      for (int c = 0; c < cols; ++c) {
+        out[c] += w * in[c];
+      }
+    }
+  }
+}
+
+// Rows [first, last) of dst (CV_32F) : src correlated by the non separable
+// kernel h, one shifted padded row per non zero tap.
+void filter2DRows(const cv::Mat &src, cv::Mat &dst, cv::Mat const &h, int first,
+                  int last) {
+  int cols = src.cols;
+  int rx = h.cols / 2, ry = h.rows / 2;
+  int width = cols + 2 * rx;
+  int n = last - first + 2 * ry;
+  std::vector<float> padded(n * width);
+  for (int i = 0; i < n; ++i) {
+    paddedRow(src, reflect101(first - ry + i, src.rows), rx, &padded[i * width]);
+  }
+
+  for (int r = first; r < last; ++r) {
+    float *out = dst.ptr<float>(r);
+    std::fill(out, out + cols, 0.f);
+    for (int v = 0; v < h.rows; ++v) {
+      const float *in = &padded[(r - first + v) * width];
+      for (int u = 0; u < h.cols; ++u) {
+        float w = h.at<float>(v, u);
+        if (w == 0.f)
+          continue;
+        for (int c = 0; c < cols; ++c) {
+          out[c] += w * in[c + u];
+        }
+      }
+    }
+  }
+}
+
+// src (CV_8UC1 or CV_32F) correlated by k into dst (CV_32F), on nb_threads
+// bands of rows (<= 0 : one per core).
+void sepFilter(const cv::Mat &src, cv::Mat &dst, kernel::Separable const &k,
+               int nb_threads = 0) {
+  assert(src.type() == CV_8UC1 || src.type() == CV_32F);
+  assert(k.row.size() % 2 == 1 && k.col.size() % 2 == 1);
+  dst.create(src.size(), CV_32F);
+  parallelFor(0, src.rows, nb_threads, [&](int first, int last, int) {
+    sepFilterRows(src, dst, k, first, last);
+  });
+}
+
+// src (CV_8UC1 or CV_32F) correlated by h (CV_32F, odd sizes) into dst
+// (CV_32F). Kernels of rank 1 go through sepFilter.
+void convolve(const cv::Mat &src, cv::Mat &dst, cv::Mat const &h, int nb_threads = 0) {
+  assert(src.type() == CV_8UC1 || src.type() == CV_32F);
+  assert(h.type() == CV_32F && h.rows % 2 == 1 && h.cols % 2 == 1);
+  kernel::Separable k;
+  if (kernel::separate(h, k)) {
+    sepFilter(src, dst, k, nb_threads);
+    return;
+  }
+  dst.create(src.size(), CV_32F);
+  parallelFor(0, src.rows, nb_threads, [&](int first, int last, int) {
+    filter2DRows(src, dst, h, first, last);
+  });
+}
+
+// Correlation of h at (x, y), whose neighbourhood must be inside img.
+float convolution(const cv::Mat &img, const cv::Mat &h, int x, int y) {
+  int rx = h.cols / 2, ry = h.rows / 2;
+  float sum = 0.0;
+  for (int u = -ry; u <= ry; ++u) {
+    for (int v = -rx; v <= rx; ++v) {
+      sum += h.at<float>(ry + u, rx + v) * img.at<uchar>(y + u, x + v);
+    }
+  }
+  return sum;
+}
+
+// src (CV_8UC1) filtered by h of any odd size, saturated to CV_8UC1, on
+// nb_threads bands of rows (<= 0 : one per core).
+void filter(const cv::Mat &src, cv::Mat &dst, const cv::Mat &h, int nb_threads = 0) {
+  assert(src.type() == CV_8UC1);
+  cv::Mat flt;
+  convolve(src, flt, h, nb_threads);
+  dst.create(src.size(), CV_8UC1);
+  parallelFor(0, src.rows, nb_threads, [&](int first, int last, int) {
+    for (int r = first; r < last; ++r) {
+      const float *in = flt.ptr<float>(r);
+      uchar *out = dst.ptr<uchar>(r);
+      for (int c = 0; c < src.cols; ++c) {
+        out[c] = cv::saturate_cast<uchar>(in[c]);
+      }
+    }
+  });
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include "opencv2/imgproc.hpp"
+#include <cstring>
+#include <map>
+#include <mutex>
+
+// Gradient directions are stored as uint8 bins over 360 degrees, DIR_BINS
+// by default (1.4 degree each).
+const int DIR_BINS = 256;
+
+// Angle (radians), cos/sin and orientation (angle modulo 180 degrees) of
+// every direction bin : voters read them instead of calling cos, sin or
+// atan2 per edge.
+struct DirectionBins {
+  int n = 0;
+  std::vector<float> angle, cos_d, sin_d, orientation;
+};
+
+// Tables are built once per resolution and shared afterwards.
+const DirectionBins &directionBins(int n = DIR_BINS) {
+  static std::map<int, DirectionBins> tables;
+  static std::mutex mutex;
+
+  std::unique_lock lock(mutex);
+  DirectionBins &bins = tables[n];
+  if (bins.angle.empty()) {
+    bins.n = n;
+    for (int b = 0; b < n; ++b) {
+      float angle = 2 * M_PI * b / n;
+      bins.angle.push_back(angle);
+      bins.cos_d.push_back(cos(angle));
+      bins.sin_d.push_back(sin(angle));
+      bins.orientation.push_back(angle < M_PI ? angle : angle - float(M_PI));
+    }
+  }
+  return bins;
+}
+
+// Edge pixels of a frame as a structure of arrays.
+// Voting loops read contiguous coordinates and their cost only depends on
+// the number of edges, not on the image area. The same list can be used by
+// the line and the circle passes of a frame.
+struct EdgePoints {
+  std::vector<int> x, y;
+  std::vector<uchar> dir; // direction bins, empty if no directions were given
+  std::vector<float> mag; // empty if no magnitudes were given
+  int dir_bins = 0;       // resolution of dir
+  int cols = 0, rows = 0; // size of the edge map
+
+  int size() const { return x.size(); }
+
+  // Tables of the direction bins, to be fetched once per call.
+  const DirectionBins &bins() const { return directionBins(dir_bins); }
+};
+
+// Gradient orientation modulo 180 degrees, in [0, pi).
+float tangentOrientation(float dir) {
+  float o = std::fmod(dir, float(M_PI));
+  return o < 0 ? o + M_PI : o;
+}
+
+// Appends the pixels of row y in [x0, x1) that are >= thresh.
+// Every candidate is written and the count only moves forward on edges, so
+// the loop doesn't branch on the pixel values.
+int compactRow(const uchar *row, int y, int x0, int x1, uchar thresh,
+               const uchar *dir, const float *mag, EdgePoints &pts, int n) {
+  int *px = pts.x.data();
+  int *py = pts.y.data();
+  uchar *pd = dir ? pts.dir.data() : nullptr;
+  float *pm = mag ? pts.mag.data() : nullptr;
+  for (int x = x0; x < x1; ++x) {
+    px[n] = x;
+    py[n] = y;
+    if (pd)
+      pd[n] = dir[x];
+    if (pm)
+      pm[n] = mag[x];
+    n += row[x] >= thresh;
+  }
+  return n;
+}
+
+// Extracts the pixels of bin >= thresh, with their direction and magnitude
+// when dirs (CV_8U, dir_bins bins) and mags (CV_32F) are given, in one pass
+// over the image.
+void extractEdges(cv::Mat const &bin, uchar thresh, EdgePoints &pts,
+                  cv::Mat const &dirs = cv::Mat(),
+                  cv::Mat const &mags = cv::Mat(), int dir_bins = DIR_BINS) {
+  assert(bin.type() == CV_8UC1);
+  assert(dirs.empty() || dirs.type() == CV_8UC1);
+  int rows = bin.rows;
+  int cols = bin.cols;
+  pts.cols = cols;
+  pts.rows = rows;
+  pts.dir_bins = dirs.empty() ? 0 : dir_bins;
+
+  auto reserve = [&](size_t size) {
+    pts.x.resize(size);
+    pts.y.resize(size);
+    if (!dirs.empty())
+      pts.dir.resize(size);
+    if (!mags.empty())
+      pts.mag.resize(size);
+  };
+  pts.dir.clear();
+  pts.mag.clear();
+  reserve(cols);
+
+  int n = 0;
+  for (int y = 0; y < rows; ++y) {
+    // room for a full row of edges
+    if ((int)pts.x.size() < n + cols)
+      reserve(std::max(2 * pts.x.size(), size_t(n + cols)));
+
+    const uchar *row = bin.ptr<uchar>(y);
+    const uchar *dir = dirs.empty() ? nullptr : dirs.ptr<uchar>(y);
+    const float *mag = mags.empty() ? nullptr : mags.ptr<float>(y);
+
+    int x = 0;
+    if (thresh > 0) {
+      // Zero pixels can't be edges : skip them 8 at a time.
+      for (; x + 8 <= cols; x += 8) {
+        uint64_t word;
+        std::memcpy(&word, row + x, 8);
+        if (word != 0)
+          n = compactRow(row, y, x, x + 8, thresh, dir, mag, pts, n);
+      }
+    }
+    n = compactRow(row, y, x, cols, thresh, dir, mag, pts, n);
+  }
+
+  reserve(n);
+}
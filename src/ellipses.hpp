@@ -0,0 +1,252 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+#include "multithreading.hpp"
+#include "twostage.hpp"
+
+// Ellipse detection
+// 1. two points of an ellipse with parallel tangents are symmetric about its
+//    center : every pair of edge points with parallel gradients votes for
+//    its midpoint in a 2D center accumulator
+// 2. for each center peak, the edge points whose symmetric is also an edge
+//    give the half major axis a (distance peak) and the orientation
+//    (principal axis)
+// 3. each of them then gives the half minor axis b of the ellipse through
+//    it, accumulated in a 1D histogram
+// Memory is one image-sized plane, plus one histogram per candidate. Each
+// center holds at most one ellipse.
+
+// Pairs votes of the points [first, last) into acc. Points are bucketed by
+// orientation so that only pairs within tolerance radians are visited. Each
+// pair (i, j) is voted once, by i or j depending on the parity of i + j so
+// that every thread gets the same share of pairs.
+// A bucket holds about a third of the edges with few orientations (MULTI_DIM
+// has 4), so the pairs are quadratic in the edges. Past max_pairs points, a
+// bucket is read with a stride, shifted by i so that every partner is still
+// sampled, and each vote weighs the stride to keep the accumulator scale.
+long long voteEllipseCenters(cv::Mat &acc, EdgePoints const &pts,
+                             std::vector<std::vector<int>> const &buckets,
+                             std::vector<int> const &bucket_of, float tolerance,
+                             int min_axis, int max_axis, int max_pairs,
+                             int first, int last) {
+  int nb_buckets = buckets.size();
+  float min_d2 = 4.f * min_axis * min_axis;
+  float max_d2 = 4.f * max_axis * max_axis;
+  const float *orientation = pts.bins().orientation.data();
+  long long pairs = 0;
+  for (int i = first; i < last; ++i) {
+    float oi = orientation[pts.dir[i]];
+    int k = bucket_of[i];
+    int neighbours[3] = {(k + nb_buckets - 1) % nb_buckets, k, (k + 1) % nb_buckets};
+    int count = std::min(3, nb_buckets);
+    for (int n = 0; n < count; ++n) {
+      std::vector<int> const &bucket = buckets[neighbours[n]];
+      int size = bucket.size();
+      int stride = max_pairs > 0 ? std::max(1, (size + max_pairs - 1) / max_pairs) : 1;
+      for (int t = i % stride; t < size; t += stride) {
+        int j = bucket[t];
+        if (j == i || (i < j) != bool((i + j) & 1))
+          continue;
+        float dx = pts.x[j] - pts.x[i];
+        float dy = pts.y[j] - pts.y[i];
+        float d2 = dx * dx + dy * dy;
+        if (d2 < min_d2 || d2 > max_d2)
+          continue;
+        float diff = std::abs(orientation[pts.dir[j]] - oi);
+        if (std::min(diff, float(M_PI) - diff) > tolerance)
+          continue;
+
+        int a = (pts.x[i] + pts.x[j] + 1) / 2;
+        int b = (pts.y[i] + pts.y[j] + 1) / 2;
+        acc.at<float>(b, a) += stride;
+        ++pairs;
+      }
+    }
+  }
+  return pairs;
+}
+
+// Center accumulator of the ellipses with half axes in [min_axis, max_axis].
+// pts must have directions. If pairs isn't null, it receives the number of
+// pairs voted.
+void houghEllipseCenters(EdgePoints const &pts, cv::Mat &acc, float tolerance_deg,
+                         HoughEllipsesParams const &params,
+                         long long *pairs = nullptr) {
+  assert(!pts.dir.empty());
+  int diag = sqrt(pts.rows * pts.rows + pts.cols * pts.cols);
+  int min_axis, max_axis;
+  radiusRange(params.min_axis, params.max_axis, diag / 2, min_axis, max_axis);
+
+  float tolerance = radians(std::max(1.f, tolerance_deg));
+  int nb_buckets = std::max(1, int(M_PI / tolerance));
+  std::vector<std::vector<int>> buckets(nb_buckets);
+  std::vector<int> bucket_of(pts.size());
+  const float *orientation = pts.bins().orientation.data();
+  for (int i = 0; i < pts.size(); ++i) {
+    bucket_of[i] = std::min(nb_buckets - 1, int(orientation[pts.dir[i]] / M_PI * nb_buckets));
+    buckets[bucket_of[i]].push_back(i);
+  }
+
+  int n = pts.size();
+  int nb_threads = lineWorkers(params.threads, n);
+  std::vector<cv::Mat> partials(nb_threads);
+  std::vector<long long> counts(nb_threads, 0);
+  parallelFor(0, n, nb_threads, [&](int first, int last, int i) {
+    partials[i] = cv::Mat::zeros(pts.rows, pts.cols, CV_32F);
+    counts[i] = voteEllipseCenters(partials[i], pts, buckets, bucket_of, tolerance,
+                                   min_axis, max_axis, params.max_pairs, first, last);
+  });
+  reduceAccumulators(partials, nb_threads);
+  acc = partials[0];
+
+  if (pairs) {
+    *pairs = 0;
+    for (long long count : counts) {
+      *pairs += count;
+    }
+  }
+}
+
+// Ellipse centered on center, fitted on the edge points symmetric about it.
+// Returns false if there is none with enough coverage.
+bool centerEllipse(EdgePoints const &pts, cv::Mat const &mask, cv::Point center,
+                   int min_axis, int max_axis, float min_coverage, Ellipse &ellipse) {
+  // points whose symmetric, up to one pixel, is an edge
+  std::vector<cv::Point2f> sym;
+  float max_d2 = float(max_axis + 1) * (max_axis + 1);
+  for (int i = 0; i < pts.size(); ++i) {
+    float dx = pts.x[i] - center.x;
+    float dy = pts.y[i] - center.y;
+    if (dx * dx + dy * dy > max_d2)
+      continue;
+    int sx = 2 * center.x - pts.x[i];
+    int sy = 2 * center.y - pts.y[i];
+    bool found = false;
+    for (int ny = sy - 1; ny <= sy + 1 && !found; ++ny) {
+      for (int nx = sx - 1; nx <= sx + 1 && !found; ++nx) {
+        found = withinMat(nx, ny, mask.cols, mask.rows) && mask.at<uchar>(ny, nx);
+      }
+    }
+    if (found)
+      sym.push_back({dx, dy});
+  }
+  if ((int)sym.size() < 8)
+    return false;
+
+  // Half major axis : the distance to the center is stationary at the tips,
+  // so a is the farthest strong peak of the histogram of the distances. It
+  // also leaves out the few points symmetric by chance.
+  std::vector<int> dist(max_axis + 3, 0);
+  for (auto &p : sym) {
+    int d = std::min(max_axis, cvRound(std::hypot(p.x, p.y)));
+    ++dist[d + 1];
+  }
+  int peak = 0;
+  for (size_t k = 1; k + 1 < dist.size(); ++k) {
+    peak = std::max(peak, dist[k - 1] + dist[k] + dist[k + 1]);
+  }
+  float a = 0;
+  for (size_t k = dist.size() - 2; k >= 1; --k) {
+    int support = dist[k - 1] + dist[k] + dist[k + 1];
+    if (support >= std::max(4, peak / 4)) {
+      // bin k is the distance k - 1
+      a = float(dist[k - 1] * (k - 2) + dist[k] * (k - 1) + dist[k + 1] * k) / support;
+      break;
+    }
+  }
+  if (a < min_axis)
+    return false;
+  auto outside = [&](cv::Point2f p) { return std::hypot(p.x, p.y) > a + 1.5f; };
+  sym.erase(std::remove_if(sym.begin(), sym.end(), outside), sym.end());
+
+  // orientation : principal axis of the symmetric points
+  float sxx = 0, syy = 0, sxy = 0;
+  for (auto &p : sym) {
+    sxx += p.x * p.x;
+    syy += p.y * p.y;
+    sxy += p.x * p.y;
+  }
+  float angle = 0.5f * atan2(2 * sxy, sxx - syy);
+  float c = cos(angle), s = sin(angle);
+
+  // half minor axis : 1D histogram of the b of the ellipse through each point,
+  // away from the tips where it is ill-conditioned
+  std::vector<int> hist(int(a) + 3, 0);
+  for (auto &p : sym) {
+    float u = (p.x * c + p.y * s) / a;
+    float v = -p.x * s + p.y * c;
+    if (std::abs(u) > 0.9f)
+      continue;
+    int b = cvRound(std::abs(v) / sqrt(1 - u * u));
+    if (b >= min_axis && b <= a)
+      ++hist[b + 1];
+  }
+  // bin k is b = k - 1, only b in [min_axis, a] is a candidate
+  int best = 0, best_b = 0;
+  for (int k = min_axis + 1; k <= int(a) + 1; ++k) {
+    int support = hist[k - 1] + hist[k] + hist[k + 1];
+    if (support > best) {
+      best = support;
+      best_b = k - 1;
+    }
+  }
+  // b = 0 would make every point lie on the ellipse
+  if (best == 0 || best_b <= 0)
+    return false;
+
+  ellipse.center = center;
+  ellipse.a = cvRound(a);
+  ellipse.b = best_b;
+  ellipse.angle = angle;
+
+  // coverage : 64 angular sectors around the center
+  uint64_t seen = 0;
+  for (int i = 0; i < pts.size(); ++i) {
+    float dx = pts.x[i] - center.x;
+    float dy = pts.y[i] - center.y;
+    float u = dx * c + dy * s;
+    float v = -dx * s + dy * c;
+    float e = sqrt(u * u / (a * a) + v * v / (best_b * best_b));
+    if (std::abs(e - 1) * best_b > 1)
+      continue;
+    int sector = int((atan2(v, u) + M_PI) * (64 / (2 * M_PI))) & 63;
+    seen |= uint64_t(1) << sector;
+  }
+  // Ramanujan's perimeter, small ellipses can't have a pixel in every sector
+  float perimeter = M_PI * (3 * (a + best_b) - sqrt((3 * a + best_b) * (a + 3 * best_b)));
+  return __builtin_popcountll(seen) / std::min(64.f, perimeter) >= min_coverage;
+}
+
+// Ellipses of the center accumulator acc : peaks above center_thresh times
+// the best center, each fitted on the edge points around it.
+std::vector<Ellipse> getEllipses(cv::Mat const &acc, EdgePoints const &pts,
+                                 float center_thresh, HoughEllipsesParams const &params) {
+  int diag = sqrt(pts.rows * pts.rows + pts.cols * pts.cols);
+  int min_axis, max_axis;
+  radiusRange(params.min_axis, params.max_axis, diag / 2, min_axis, max_axis);
+
+  cv::Mat mask = cv::Mat::zeros(pts.rows, pts.cols, CV_8UC1);
+  for (int i = 0; i < pts.size(); ++i) {
+    mask.at<uchar>(pts.y[i], pts.x[i]) = 1;
+  }
+
+  double max;
+  minmax(acc, nullptr, &max);
+  auto centers = centerPeaks(acc, center_thresh * max, params.peak_radius);
+
+  std::vector<char> found(centers.size(), 0);
+  std::vector<Ellipse> candidates(centers.size());
+  parallelFor(0, centers.size(), params.threads, [&](int first, int last, int) {
+    for (int c = first; c < last; ++c) {
+      found[c] = centerEllipse(pts, mask, centers[c], min_axis, max_axis,
+                               params.min_coverage, candidates[c]);
+    }
+  });
+
+  std::vector<Ellipse> ellipses;
+  for (size_t c = 0; c < centers.size(); ++c) {
+    if (found[c])
+      ellipses.push_back(candidates[c]);
+  }
+  return ellipses;
+}
@@ -0,0 +1,207 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+#include "multithreading.hpp"
+#include "twostage.hpp"
+
+// Generalized Hough transform
+// 1. the edges of a template are stored in an R-table : for each gradient
+//    orientation bin, the offsets from the edge to a reference point
+// 2. every edge of the image looks up the entries of its orientation, turned
+//    and scaled for each pose searched, and votes the reference points
+// 3. peaks of the (pose, y, x) accumulator are the occurrences
+// The accumulator has one plane per pose, of one cell per cell_size^2 pixels.
+
+struct RTable {
+  int nb_bins = 0;
+  std::vector<std::vector<cv::Point2f>> offsets; // edge to reference, per bin
+  std::vector<cv::Point2f> outline; // template edges, relative to the reference
+  float radius = 0.f;               // mean distance of the edges to the reference
+};
+
+// R-table of the template edges tpl, which must have directions. The
+// reference point is their centroid.
+RTable buildRTable(EdgePoints const &tpl, int nb_bins) {
+  assert(!tpl.dir.empty());
+  RTable table;
+  table.nb_bins = std::max(1, nb_bins);
+  table.offsets.resize(table.nb_bins);
+
+  cv::Point2f ref(0, 0);
+  for (int i = 0; i < tpl.size(); ++i) {
+    ref += cv::Point2f(tpl.x[i], tpl.y[i]);
+  }
+  ref *= 1.f / std::max(1, tpl.size());
+
+  const float *orientation = tpl.bins().orientation.data();
+  for (int i = 0; i < tpl.size(); ++i) {
+    cv::Point2f p = cv::Point2f(tpl.x[i], tpl.y[i]) - ref;
+    int bin = std::min(table.nb_bins - 1,
+                       int(orientation[tpl.dir[i]] / M_PI * table.nb_bins));
+    table.offsets[bin].push_back(-p);
+    table.outline.push_back(p);
+    table.radius += std::hypot(p.x, p.y);
+  }
+  table.radius /= std::max(1, tpl.size());
+  return table;
+}
+
+// Values of [min, max] by step, min alone if the range is empty.
+std::vector<float> poseRange(float min, float max, float step) {
+  std::vector<float> values{min};
+  if (step > 0) {
+    for (float v = min + step; v <= max + 1e-4f; v += step) {
+      values.push_back(v);
+    }
+  }
+  return values;
+}
+
+// R-table turned and scaled for every pose, in one array. The entries of
+// pose p and bin k are [start[p * nb_bins + k], start[p * nb_bins + k + 1]).
+// Pose p is angles[p / scales.size()] and scales[p % scales.size()].
+struct PoseTable {
+  std::vector<float> angles, scales; // radians, factors
+  std::vector<int> start;
+  std::vector<cv::Point2f> offsets;
+
+  int size() const { return angles.size() * scales.size(); }
+  float angle(int p) const { return angles[p / scales.size()]; }
+  float scale(int p) const { return scales[p % scales.size()]; }
+};
+
+PoseTable buildPoseTable(RTable const &table, HoughShapesParams const &params) {
+  PoseTable poses;
+  for (float angle : poseRange(params.min_angle, params.max_angle, params.angle_step)) {
+    poses.angles.push_back(radians(angle));
+  }
+  poses.scales = poseRange(params.min_scale, params.max_scale, params.scale_step);
+
+  for (int p = 0; p < poses.size(); ++p) {
+    float c = cos(poses.angle(p)) * poses.scale(p);
+    float s = sin(poses.angle(p)) * poses.scale(p);
+    for (int k = 0; k < table.nb_bins; ++k) {
+      poses.start.push_back(poses.offsets.size());
+      for (auto &o : table.offsets[k]) {
+        poses.offsets.push_back({o.x * c - o.y * s, o.x * s + o.y * c});
+      }
+    }
+  }
+  poses.start.push_back(poses.offsets.size());
+  return poses;
+}
+
+// Votes of the points [first, last) into acc, whose plane p holds the
+// reference points of pose p. Each point only reads the bins within window
+// of its orientation, rotated back by the pose angle, each of them once.
+void voteShapes(cv::Mat &acc, EdgePoints const &pts, PoseTable const &poses,
+                int nb_bins, int window, int cell, int first, int last) {
+  int rows = (pts.rows + cell - 1) / cell;
+  int cols = (pts.cols + cell - 1) / cell;
+  float inv_cell = 1.f / cell;
+  int span = std::min(2 * window + 1, nb_bins);
+  // orientation shift of each angle, in bins
+  std::vector<float> shifts;
+  for (float angle : poses.angles) {
+    shifts.push_back(tangentOrientation(angle) / M_PI * nb_bins);
+  }
+  // orientation of each direction bin, in R-table bins
+  std::vector<float> dir_to_bin;
+  for (float orientation : pts.bins().orientation) {
+    dir_to_bin.push_back(orientation / M_PI * nb_bins);
+  }
+
+  for (int i = first; i < last; ++i) {
+    float x = pts.x[i], y = pts.y[i];
+    float bin = dir_to_bin[pts.dir[i]];
+    for (int p = 0; p < poses.size(); ++p) {
+      int center = int(bin - shifts[p / poses.scales.size()] + nb_bins) % nb_bins;
+      float *plane = acc.ptr<float>(p * rows);
+      for (int d = 0; d < span; ++d) {
+        int k = (center - window + d + nb_bins) % nb_bins;
+        const int *range = &poses.start[p * nb_bins + k];
+        for (int e = range[0]; e < range[1]; ++e) {
+          int a = (x + poses.offsets[e].x) * inv_cell;
+          int b = (y + poses.offsets[e].y) * inv_cell;
+          if (withinMat(a, b, cols, rows))
+            plane[b * cols + a] += 1;
+        }
+      }
+    }
+  }
+}
+
+// Accumulator of the poses of table, one plane of (rows / cell) x
+// (cols / cell) per pose stacked along the rows. pts must have directions,
+// tolerance_deg is the orientation error between the template and the image.
+void generalizedHough(EdgePoints const &pts, RTable const &table, PoseTable const &poses,
+                      cv::Mat &acc, float tolerance_deg, HoughShapesParams const &params) {
+  assert(!pts.dir.empty());
+  int cell = std::max(1, params.cell_size);
+  int rows = (pts.rows + cell - 1) / cell;
+  int cols = (pts.cols + cell - 1) / cell;
+
+  // plus one bin : template and image orientations are both binned
+  float bin_width = M_PI / table.nb_bins;
+  int window = std::ceil(radians(std::max(0.f, tolerance_deg)) / bin_width) + 1;
+  window = std::min(window, table.nb_bins);
+
+  int n = pts.size();
+  int nb_threads = lineWorkers(params.threads, n);
+  std::vector<cv::Mat> partials(nb_threads);
+  parallelFor(0, n, nb_threads, [&](int first, int last, int i) {
+    partials[i] = cv::Mat::zeros(poses.size() * rows, cols, CV_32F);
+    voteShapes(partials[i], pts, poses, table.nb_bins, window, cell, first, last);
+  });
+  reduceAccumulators(partials, nb_threads);
+  acc = partials[0];
+}
+
+// Occurrences of the template whose votes reach thresh times the best cell.
+// Peaks of a plane are kept if no stronger one, of any pose, is closer than
+// the template radius : occurrences that close would overlap.
+std::vector<ShapeMatch> getShapes(cv::Mat const &acc, RTable const &table,
+                                  PoseTable const &poses, float thresh,
+                                  HoughShapesParams const &params) {
+  int cell = std::max(1, params.cell_size);
+  int rows = acc.rows / poses.size();
+
+  double max;
+  minmax(acc, nullptr, &max);
+
+  std::vector<std::vector<ShapeMatch>> found(poses.size());
+  parallelFor(0, poses.size(), params.threads, [&](int first, int last, int) {
+    for (int p = first; p < last; ++p) {
+      cv::Mat plane = acc.rowRange(p * rows, (p + 1) * rows);
+      for (auto &peak : centerPeaks(plane, thresh * max, params.peak_radius)) {
+        ShapeMatch match;
+        match.position = peak * cell + cv::Point(cell / 2, cell / 2);
+        match.angle = poses.angle(p);
+        match.scale = poses.scale(p);
+        match.votes = plane.at<float>(peak.y, peak.x);
+        found[p].push_back(match);
+      }
+    }
+  });
+
+  std::vector<ShapeMatch> candidates;
+  for (auto &matches : found) {
+    candidates.insert(candidates.end(), matches.begin(), matches.end());
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](ShapeMatch const &m1, ShapeMatch const &m2) { return m1.votes > m2.votes; });
+
+  float min_dist = std::max(float(cell * params.peak_radius),
+                            table.radius * poses.scales.front());
+  std::vector<ShapeMatch> matches;
+  for (auto &candidate : candidates) {
+    bool close = false;
+    for (auto &match : matches) {
+      cv::Point d = candidate.position - match.position;
+      close = close || std::hypot(d.x, d.y) < min_dist;
+    }
+    if (!close)
+      matches.push_back(candidate);
+  }
+  return matches;
+}
@@ -1,133 +1,532 @@
 #pragma once
 #include "opencv2/imgproc.hpp"
+#include "convolution.hpp"
+#include "edges.hpp"
 #include "utils.hpp"
 #include "kernel.hpp"
+#include <array>
+#include <type_traits>
+#include <utility>
 
 enum Dimension {
     TWO_DIM=2,
     MULTI_DIM=4
 };
 
-std::vector<cv::Mat> computeGradients(const cv::Mat& src, const cv::Mat& h, Dimension dim=MULTI_DIM)
+// Uncertainty on the gradient direction, in degrees on each side.
+// MULTI_DIM directions are quantized by 45 degrees, TWO_DIM ones come from
+// atan2 on a 3x3 kernel and are only off by a few degrees.
+float directionTolerance(Dimension dim)
 {
-    assert(h.rows == 3 && h.cols == 3);
-    int height = src.rows;
-    int width = src.cols;
+    return dim == MULTI_DIM ? 22.5f : 5.f;
+}
+
+// atan2(y, x) in [0, 2 pi), without branches nor calls so that loops using
+// it vectorize : polynomial on the octant, max error 1e-4 rad (0.006 deg).
+inline float fastAtan2(float y, float x)
+{
+    float ax = std::abs(x), ay = std::abs(y);
+    float c = std::min(ax, ay) / (std::max(ax, ay) + 1e-10f);
+    float c2 = c * c;
+    float a = (((-0.0443265555f * c2 + 0.1555786518f) * c2 - 0.3258083974f) * c2 + 0.9997878412f) * c;
+    a = ay > ax ? float(M_PI_2) - a : a;
+    a = x < 0 ? float(M_PI) - a : a;
+    return y < 0 ? float(2 * M_PI) - a : a;
+}
+
+// Direction bin, out of nb_bins over 360 degrees, of the angle a in
+// [0, 2 pi].
+inline uchar directionBin(float a, int nb_bins)
+{
+    int bin = int(a * (nb_bins / float(2 * M_PI)) + 0.5f);
+    return bin >= nb_bins ? bin - nb_bins : bin;
+}
 
-    std::vector<cv::Mat> krns(dim);
-    krns[0] = h;
-    for (int i = 1; i < dim; ++i) {
-        krns[i] = kernel::rotate(krns[i-1]);
-        if (dim == 2) {
-            krns[i] = kernel::rotate(krns[i]);
+// Radians of a map of nb_bins direction bins, for the code reading angles.
+cv::Mat directionAngles(const cv::Mat& dirs, int nb_bins = DIR_BINS)
+{
+    assert(dirs.type() == CV_8UC1);
+    const DirectionBins& bins = directionBins(nb_bins);
+    cv::Mat angles(dirs.size(), CV_32F);
+    for (int r = 0; r < dirs.rows; ++r) {
+        const uchar* in = dirs.ptr<uchar>(r);
+        float* out = angles.ptr<float>(r);
+        for (int c = 0; c < dirs.cols; ++c) {
+            out[c] = bins.angle[in[c]];
         }
     }
+    return angles;
+}
 
-    std::vector<cv::Mat> grads(dim);
-    for (int k = 0; k < dim; ++k) {
-        grads[k] = cv::Mat::zeros(src.size(), CV_32F);
+// Adds the tap t of the kernel K turned by 45 degrees steps times, nothing
+// if its coefficient is zero.
+template <const float* K, int steps, int t>
+inline void tap(float& sum, const float* n)
+{
+    constexpr float w = kernel::rotated(K, steps)[t];
+    if constexpr (w != 0.f) {
+        sum += w * n[t];
     }
+}
 
-    for (int r = 1; r < height - 1; ++r) {
-        for (int c = 1; c < width - 1; ++c) {
-            for (int k = 0; k < dim; ++k) {
-                float val = convolution(src, krns[k], c, r);
-                grads[k].at<float>(r, c) = val;
-            }
+// Response of K turned steps times on the 3x3 neighbourhood n, unrolled at
+// compile time, in the same order of the products as convolution().
+template <const float* K, int steps, std::size_t... t>
+inline float response(const float* n, std::index_sequence<t...>)
+{
+    float sum = 0.0;
+    (tap<K, steps, t>(sum, n), ...);
+    return sum;
+}
+
+// The dim oriented responses : K turned by 45 degrees each time (90 degrees
+// with two directions).
+template <const float* K, int dim, std::size_t... k>
+inline void responses(const float* n, float* g, std::index_sequence<k...>)
+{
+    ((g[k] = response<K, k * 4 / dim>(n, std::make_index_sequence<9>())), ...);
+}
+
+// Strongest of the 4 oriented responses g of column c : its magnitude, its
+// direction (radians or bins) and its sector.
+template <typename T>
+inline void strongestResponse(const float* g, int c, float* mag, T* dir, uchar* sector,
+                              int nb_bins)
+{
+    float sup = abs(g[0]);
+    int d = 0;
+    for (int k = 1; k < MULTI_DIM; ++k) {
+        float tmp = abs(g[k]);
+        d = tmp > sup ? k : d;
+        sup = tmp > sup ? tmp : sup;
+    }
+    mag[c] = sup;
+    sector[c] = d;
+    if constexpr (std::is_same<T, uchar>::value) {
+        dir[c] = (d * nb_bins + 4) / 8;
+    } else {
+        dir[c] = d*M_PI_4;
+    }
+}
+
+// Norm, angle and sector of the responses gx and gy of the columns
+// [first, last), one loop each so that all but sqrt vectorize.
+template <typename T>
+void polarRow(const float* gx, const float* gy, int first, int last, float* mag, T* dir,
+              uchar* sector, int nb_bins)
+{
+    for (int c = first; c < last; ++c) {
+        mag[c] = sqrt(gx[c]*gx[c]+gy[c]*gy[c]);
+    }
+    // tan(22.5 degrees) : below it, the gradient is along an axis
+    const float tan_sector = 0.41421356f;
+    for (int c = first; c < last; ++c) {
+        float ax = std::abs(gx[c]), ay = std::abs(gy[c]);
+        uchar diagonal = gx[c] * gy[c] > 0 ? 1 : 3;
+        sector[c] = ay <= tan_sector * ax ? 0 : ax <= tan_sector * ay ? 2 : diagonal;
+    }
+    if constexpr (std::is_same<T, uchar>::value) {
+        for (int c = first; c < last; ++c) {
+            dir[c] = directionBin(fastAtan2(gy[c], gx[c]), nb_bins);
+        }
+    } else {
+        for (int c = first; c < last; ++c) {
+            dir[c] = atan2(gy[c], gx[c]);
         }
     }
+}
 
-    return grads;
+// Fused gradient of row r, between the row pointers p0, p1, p2 : each 3x3
+// neighbourhood is read once, the dim oriented responses of K stay in
+// registers and only the magnitude and the direction are written. The
+// direction is in radians (T = float) or in nb_bins bins (T = uchar);
+// sector receives the closest of the 0, 45, 90 and 135 degrees directions,
+// for the non-maximum suppression. gx and gy are row buffers : sqrt doesn't
+// vectorize, it's done on them in a second loop so that the others do.
+template <const float* K, int dim, typename T>
+void gradientRow(const uchar* p0, const uchar* p1, const uchar* p2, int cols,
+                 float* mag, T* dir, uchar* sector, float* gx, float* gy, int nb_bins)
+{
+    for (int c = 1; c < cols - 1; ++c) {
+        float n[9] = {
+            float(p0[c - 1]), float(p0[c]), float(p0[c + 1]),
+            float(p1[c - 1]), float(p1[c]), float(p1[c + 1]),
+            float(p2[c - 1]), float(p2[c]), float(p2[c + 1])
+        };
+        float g[dim];
+        responses<K, dim>(n, g, std::make_index_sequence<dim>());
+        if constexpr (dim == TWO_DIM) {
+            gx[c] = g[0];
+            gy[c] = g[1];
+        } else {
+            strongestResponse(g, c, mag, dir, sector, nb_bins);
+        }
+    }
+
+    if constexpr (dim == TWO_DIM) {
+        polarRow(gx, gy, 1, cols - 1, mag, dir, sector, nb_bins);
+    }
 }
 
-void magnitudeBD(std::vector<cv::Mat> const& grads, cv::Mat & mags, cv::Mat & dirs)
+// Gradient of a row from the responses gx and gy of the derivatives along x
+// and y : with four directions, the ones at 45 and 135 degrees are steered
+// from them.
+template <int dim, typename T>
+void steeredRow(const float* gx, const float* gy, int cols, float* mag, T* dir,
+                uchar* sector, int nb_bins)
 {
-    mags = cv::Mat::zeros(grads[0].size(), CV_32F);
-    dirs = cv::Mat::zeros(grads[0].size(), CV_32F);
-    int rows = grads[0].rows;
-    int cols = grads[0].cols;
-    for (int r = 1; r < rows-1; ++r) {
-        for (int c = 1; c < cols-1; ++c) {
-            float gx = grads[0].at<float>(r, c);
-            float gy = grads[1].at<float>(r, c);
-            float mag = sqrt(gx*gx+gy*gy);
-            float dir = atan2(gy, gx);
+    if constexpr (dim == TWO_DIM) {
+        polarRow(gx, gy, 1, cols - 1, mag, dir, sector, nb_bins);
+    } else {
+        for (int c = 1; c < cols - 1; ++c) {
+            float g[MULTI_DIM] = {
+                gx[c], float(M_SQRT1_2) * (gx[c] + gy[c]),
+                gy[c], float(M_SQRT1_2) * (gy[c] - gx[c])
+            };
+            strongestResponse(g, c, mag, dir, sector, nb_bins);
+        }
+    }
+}
 
-            mags.at<float>(r, c) = mag;
-            dirs.at<float>(r, c) = dir;
+// Neighbours across an edge whose gradient is at 0, 45, 90 or 135 degrees.
+const int ACROSS_DX[4] = {1, 1, 0, -1};
+const int ACROSS_DY[4] = {0, 1, 1, 1};
+
+// Non-maximum suppression of the magnitudes cur, between the rows prev and
+// next, sector being the direction of cur as given by gradientRow : a pixel
+// is kept if it's above its neighbour before it across the edge and not
+// below the one after it, so a plateau keeps one pixel.
+void suppressRow(const float* prev, const float* cur, const float* next, const uchar* sector,
+                 int cols, float* out)
+{
+    for (int c = 1; c < cols - 1; ++c) {
+        int s = sector[c];
+        int dx = ACROSS_DX[s];
+        const float* before = ACROSS_DY[s] ? prev : cur;
+        const float* after = ACROSS_DY[s] ? next : cur;
+        float m = cur[c];
+        out[c] = m > before[c - dx] && m >= after[c + dx] ? m : 0.f;
+    }
+}
+
+// Magnitudes and directions of the rows [1, rows - 1), computed by
+// row(r, mag, sector), which also writes the row r of dirs. The magnitudes
+// are stored, or thinned, as gradient() describes.
+template <typename RowFn>
+void gradientRows(cv::Size size, cv::Mat& mags, cv::Mat& dirs, int mag_type, bool thin,
+                  int dir_bins, RowFn row)
+{
+    int rows = size.height;
+    int cols = size.width;
+    mags = cv::Mat::zeros(size, mag_type);
+    dirs = cv::Mat::zeros(size, dir_bins ? CV_8U : CV_32F);
+
+    // the magnitudes of 3 rows, a row of zeros and the output row
+    std::vector<float> buf(5 * cols, 0.f);
+    float* ring[3] = {buf.data(), buf.data() + cols, buf.data() + 2 * cols};
+    float* zeros = buf.data() + 3 * cols;
+    float* out = buf.data() + 4 * cols;
+    // sectors of the 3 rows of magnitudes
+    std::vector<uchar> sectors(3 * cols, 0);
+
+    auto store = [&](int r, const float* m) {
+        if (mag_type == CV_32F) {
+            std::copy(m + 1, m + cols - 1, mags.ptr<float>(r) + 1);
+        } else {
+            uchar* mag = mags.ptr<uchar>(r);
+            for (int c = 1; c < cols - 1; ++c) {
+                mag[c] = cv::saturate_cast<uchar>(m[c]);
+            }
+        }
+    };
+
+    for (int r = 1; r < rows - 1; ++r) {
+        float* mag = ring[r % 3];
+        row(r, mag, &sectors[(r % 3) * cols]);
+
+        if (!thin) {
+            store(r, mag);
+        } else if (r >= 2) {
+            // row 0 is the frame, its ring row is still zero
+            suppressRow(ring[(r - 2) % 3], ring[(r - 1) % 3], mag, &sectors[((r - 1) % 3) * cols],
+                        cols, out);
+            store(r - 1, out);
         }
     }
+    if (thin && rows > 2) {
+        int r = rows - 2;
+        suppressRow(r > 1 ? ring[(r - 1) % 3] : zeros, ring[r % 3], zeros,
+                    &sectors[(r % 3) * cols], cols, out);
+        store(r, out);
+    }
 }
 
-void magnitudeMD(std::vector<cv::Mat> const& grads, cv::Mat & mags, cv::Mat & dirs)
+// Gradient of src (CV_8UC1) for the 3x3 kernel K, in one pass without the
+// per-kernel response images : each kernel and dimension has its own
+// specialization.
+template <const float* K, int dim>
+void gradientOf(const cv::Mat& src, cv::Mat& mags, cv::Mat& dirs, int mag_type, bool thin,
+                int dir_bins)
 {
-    mags = cv::Mat::zeros(grads[0].size(), CV_32F);
-    dirs = cv::Mat::zeros(grads[0].size(), CV_32F);
-    int rows = grads[0].rows;
-    int cols = grads[0].cols;
+    int cols = src.cols;
+    std::vector<float> buf(2 * cols, 0.f);
+    float* gx = buf.data();
+    float* gy = gx + cols;
+    gradientRows(src.size(), mags, dirs, mag_type, thin, dir_bins,
+                 [&](int r, float* mag, uchar* sector) {
+        const uchar* p0 = src.ptr<uchar>(r - 1);
+        const uchar* p1 = src.ptr<uchar>(r);
+        const uchar* p2 = src.ptr<uchar>(r + 1);
+        if (dir_bins == 0) {
+            gradientRow<K, dim>(p0, p1, p2, cols, mag, dirs.ptr<float>(r), sector, gx, gy, 0);
+        } else {
+            gradientRow<K, dim>(p0, p1, p2, cols, mag, dirs.ptr<uchar>(r), sector, gx, gy,
+                                dir_bins);
+        }
+    });
+}
+
+// Gradient of src (CV_8UC1) for a separable derivative along x, k (its
+// transpose derives along y) : both responses are computed by sepFilter,
+// borders reflected, so kernels larger than 3x3 don't widen the frame. One
+// thread, as the 3x3 kernels : the tiled pipeline runs a gradient per band.
+template <int dim>
+void gradientSeparable(const cv::Mat& src, kernel::Separable const& k, cv::Mat& mags,
+                       cv::Mat& dirs, int mag_type, bool thin, int dir_bins)
+{
+    cv::Mat gx, gy;
+    sepFilter(src, gx, k, 1);
+    sepFilter(src, gy, k.transposed(), 1);
+    gradientRows(src.size(), mags, dirs, mag_type, thin, dir_bins,
+                 [&](int r, float* mag, uchar* sector) {
+        const float* x = gx.ptr<float>(r);
+        const float* y = gy.ptr<float>(r);
+        if (dir_bins == 0) {
+            steeredRow<dim>(x, y, src.cols, mag, dirs.ptr<float>(r), sector, 0);
+        } else {
+            steeredRow<dim>(x, y, src.cols, mag, dirs.ptr<uchar>(r), sector, dir_bins);
+        }
+    });
+}
+
+// Derivative of Gaussian of size x size.
+template <int size, int dim>
+void gradientDoG(const cv::Mat& src, cv::Mat& mags, cv::Mat& dirs, int mag_type, bool thin,
+                 int dir_bins)
+{
+    static const kernel::Separable k = kernel::derivativeOfGaussian(size);
+    gradientSeparable<dim>(src, k, mags, dirs, mag_type, thin, dir_bins);
+}
+
+using GradientFn = void (*)(const cv::Mat&, cv::Mat&, cv::Mat&, int, bool, int);
+
+// Specializations of every kernel::Gradient, with two and four directions.
+const GradientFn GRADIENT_TABLE[kernel::GRADIENT_COUNT][2] = {
+    {gradientOf<kernel::prewitt, TWO_DIM>, gradientOf<kernel::prewitt, MULTI_DIM>},
+    {gradientOf<kernel::sobel, TWO_DIM>, gradientOf<kernel::sobel, MULTI_DIM>},
+    {gradientOf<kernel::kirsch, TWO_DIM>, gradientOf<kernel::kirsch, MULTI_DIM>},
+    {gradientDoG<5, TWO_DIM>, gradientDoG<5, MULTI_DIM>},
+    {gradientDoG<7, TWO_DIM>, gradientDoG<7, MULTI_DIM>}
+};
+
+// Gradient magnitude and direction of src (CV_8UC1) for the kernel krn
+// (kernel::Gradient), 3x3 or a larger derivative of Gaussian that replaces
+// the smoothing pre-pass on noisy images. With two directions, the magnitude is the norm of
+// both responses and the direction their angle; with four, the strongest
+// response and its angle. mags is CV_32F or CV_8U (mag_type), dirs is CV_8U
+// with dir_bins bins over 360 degrees (at most 256), or CV_32F radians if
+// dir_bins is 0; the one pixel frame stays at zero. With bins, two
+// directions use fastAtan2.
+// If thin, the magnitudes that aren't a maximum across the edge are set to
+// zero : three rows of magnitudes are kept, and a row is suppressed as soon
+// as the one below it is computed.
+void gradient(const cv::Mat& src, int krn, cv::Mat& mags, cv::Mat& dirs,
+              Dimension dim = MULTI_DIM, int mag_type = CV_32F, bool thin = false,
+              int dir_bins = DIR_BINS)
+{
+    assert(src.type() == CV_8UC1);
+    assert(krn >= 0 && krn < kernel::GRADIENT_COUNT);
+    assert(mag_type == CV_32F || mag_type == CV_8U);
+    assert(dir_bins >= 0 && dir_bins <= 256);
+    GRADIENT_TABLE[krn][dim == MULTI_DIM](src, mags, dirs, mag_type, thin, dir_bins);
+}
+
+// Hysteresis thresholding : pixels > sh are edges, and so are the pixels
+// > sb 8-connected to one of them through pixels > sb. Strong pixels seed a
+// worklist, each pixel is pushed at most once. The one pixel frame stays at
+// zero.
+void hysteresis(cv::Mat const& src, cv::Mat & dest, uchar sh, uchar sb) 
+{
+    assert(src.type() == CV_8UC1);
+    dest = cv::Mat::zeros(src.size(), src.type());
+    int rows = src.rows;
+    int cols = src.cols;
+
+    std::vector<cv::Point> stack;
     for (int r = 1; r < rows-1; ++r) {
+        const uchar* in = src.ptr<uchar>(r);
+        uchar* out = dest.ptr<uchar>(r);
         for (int c = 1; c < cols-1; ++c) {
-            float sup = abs(grads[0].at<float>(r, c));
-            float dir = 0.f;
-            for (int k = 1; k < grads.size(); ++k) {
-                float tmp = abs(grads[k].at<float>(r, c));
-                if (tmp > sup) {
-                    sup = tmp;
-                    dir = k;
+            if (in[c] > sh) {
+                out[c] = 255;
+                stack.push_back({c, r});
+            }
+        }
+    }
+
+    while (!stack.empty()) {
+        cv::Point p = stack.back();
+        stack.pop_back();
+        for (int r = std::max(1, p.y-1); r <= std::min(rows-2, p.y+1); ++r) {
+            const uchar* in = src.ptr<uchar>(r);
+            uchar* out = dest.ptr<uchar>(r);
+            for (int c = std::max(1, p.x-1); c <= std::min(cols-2, p.x+1); ++c) {
+                if (!out[c] && in[c] > sb) {
+                    out[c] = 255;
+                    stack.push_back({c, r});
                 }
             }
-            float val = sup;
-            mags.at<float>(r, c) = val;
-            dirs.at<float>(r, c) = dir*M_PI_4;
         }
     }
 }
 
-bool checkNeighbors(cv::Mat const& img, unsigned int r, unsigned int c) 
+// Root of pixel i, halving the path on the way.
+int findRoot(std::vector<int> & parent, int i)
 {
-    for (int i = -1; i < 1; ++i) {
-        for (int j = -1; j < 1; ++j) {
-            if (i == 0 && j == 0) continue;
-            if (img.at<uchar>(r-i,c-j) > 0) 
-                return true;
-        }
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
     }
+    return i;
+}
 
-    return false;
+// Merges the components of pixels i and j, the smallest root wins so that
+// the result doesn't depend on the order of the unions.
+void unite(std::vector<int> & parent, std::vector<uchar> & strong, int i, int j)
+{
+    i = findRoot(parent, i);
+    j = findRoot(parent, j);
+    if (i == j)
+        return;
+    if (j < i)
+        std::swap(i, j);
+    parent[j] = i;
+    strong[i] |= strong[j];
 }
 
-void hysteresis(cv::Mat const& src, cv::Mat & dest, uchar sh, uchar sb) 
+// Union-find labels of the pixels > sb of the rows [first, last) of mags,
+// columns 1 to cols-2, 8-connected within these rows. Pixels are numbered in
+// row-major order from parent.size(), visit(r, c, i) is called on each one,
+// and strong flags the components holding a pixel > sh.
+template <typename Visit>
+void labelRows(cv::Mat const& mags, int first, int last, uchar sh, uchar sb,
+               std::vector<int> & parent, std::vector<uchar> & strong, Visit visit)
+{
+    assert(mags.type() == CV_8UC1);
+    int cols = mags.cols;
+    // label of each column in the previous and the current row, -1 : none
+    std::vector<int> prev(cols + 1, -1), cur(cols + 1, -1);
+    for (int r = first; r < last; ++r) {
+        const uchar* in = mags.ptr<uchar>(r);
+        std::fill(cur.begin(), cur.end(), -1);
+        for (int c = 1; c < cols-1; ++c) {
+            if (in[c] <= sb)
+                continue;
+            int i = parent.size();
+            parent.push_back(i);
+            strong.push_back(in[c] > sh);
+            visit(r, c, i);
+            cur[c] = i;
+            // neighbours already scanned
+            if (cur[c - 1] >= 0)
+                unite(parent, strong, i, cur[c - 1]);
+            for (int j = c - 1; j <= c + 1; ++j) {
+                if (prev[j] >= 0)
+                    unite(parent, strong, i, prev[j]);
+            }
+        }
+        std::swap(prev, cur);
+    }
+}
+
+// Same result as hysteresis, on nb_threads bands of rows. Each band labels
+// its pixels > sb with labelRows. The band labels are then gathered in one
+// union-find where the components crossing the band borders are merged, and
+// every pixel finally takes the flag of its root.
+void hysteresisMT(cv::Mat const& src, cv::Mat & dest, uchar sh, uchar sb, int nb_threads = 0)
 {
     assert(src.type() == CV_8UC1);
     dest = cv::Mat::zeros(src.size(), src.type());
     int rows = src.rows;
     int cols = src.cols;
+    if (rows < 3 || cols < 3)
+        return;
 
-    // Premier parcours
-    for (int r = 1; r < rows-1; ++r) {
+    if (nb_threads <= 0)
+        nb_threads = hardwareThreads();
+    nb_threads = std::max(1, std::min(nb_threads, rows - 2));
+
+    // label of each pixel in its band, -1 : not a candidate
+    std::vector<int> label(rows * cols, -1);
+    std::vector<std::vector<int>> band_parent(nb_threads);
+    std::vector<std::vector<uchar>> band_strong(nb_threads);
+    std::vector<int> band_first(nb_threads);
+    parallelFor(1, rows-1, nb_threads, [&](int first, int last, int t) {
+        band_first[t] = first;
+        labelRows(src, first, last, sh, sb, band_parent[t], band_strong[t],
+                  [&](int r, int c, int i) { label[r * cols + c] = i; });
+    });
+
+    // band t labels start at offset[t]
+    std::vector<int> offset(nb_threads + 1, 0);
+    for (int t = 0; t < nb_threads; ++t)
+        offset[t + 1] = offset[t] + band_parent[t].size();
+    std::vector<int> parent(offset[nb_threads]);
+    std::vector<uchar> strong(offset[nb_threads]);
+    for (int t = 0; t < nb_threads; ++t) {
+        for (size_t i = 0; i < band_parent[t].size(); ++i) {
+            parent[offset[t] + i] = offset[t] + band_parent[t][i];
+            strong[offset[t] + i] = band_strong[t][i];
+        }
+    }
+
+    for (int t = 1; t < nb_threads; ++t) {
+        const int* cur = &label[band_first[t] * cols];
+        const int* above = cur - cols;
         for (int c = 1; c < cols-1; ++c) {
-            if (src.at<uchar>(r, c) > sh) {
-                dest.at<uchar>(r, c) = 255;
+            if (cur[c] < 0)
+                continue;
+            for (int j = c - 1; j <= c + 1; ++j) {
+                if (above[j] >= 0)
+                    unite(parent, strong, offset[t] + cur[c], offset[t-1] + above[j]);
             }
         }
     }
 
-    // Second parcour
-    for (int r = 1; r < rows-1; ++r) {
-        for (int c = 1; c < cols-1; ++c) {
-            uchar val = src.at<uchar>(r, c);
-            if (val <= sh && val > sb) {
-                if (checkNeighbors(dest, r, c)) {
-                    dest.at<uchar>(r, c) = 255;
+    // read only from here : roots are found without compressing
+    parallelFor(1, rows-1, nb_threads, [&](int first, int last, int t) {
+        for (int r = first; r < last; ++r) {
+            const int* lbl = &label[r * cols];
+            uchar* out = dest.ptr<uchar>(r);
+            for (int c = 1; c < cols-1; ++c) {
+                if (lbl[c] < 0)
+                    continue;
+                int i = offset[t] + lbl[c];
+                while (parent[i] != i) {
+                    i = parent[i];
                 }
+                out[c] = strong[i] ? 255 : 0;
             }
         }
-    }
+    });
 }
 
-void direction(cv::Mat const& mags, cv::Mat & dest, cv::Mat const& dirs)
+// bins is CV_32F radians or CV_8U with nb_bins bins, as given to gradient.
+void direction(cv::Mat const& mags, cv::Mat & dest, cv::Mat const& bins,
+               int nb_bins = DIR_BINS)
 {
     assert(mags.type() == CV_8UC1);
+    cv::Mat dirs = bins.type() == CV_32F ? bins : directionAngles(bins, nb_bins);
     dest = cv::Mat::zeros(mags.size(), CV_8UC3);
     int rows = mags.rows;
     int cols = mags.cols;
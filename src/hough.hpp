@@ -1,12 +1,24 @@
 #pragma once
 #include "opencv2/imgproc.hpp"
+#include "edges.hpp"
 #include "utils.hpp"
-#include <stack>
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <mutex>
 
 struct Line {
   cv::Point2i position_in_acc;
   float theta = 0.f;
   float rho = 0.f;
+  float votes = 0.f;
+};
+
+// Part of a line supported by edge pixels.
+struct Segment {
+  cv::Point p1, p2;
+  Line line;
+  int support = 0; // number of edge pixels on the segment
 };
 
 struct Circle {
@@ -14,9 +26,176 @@ struct Circle {
   int radius;
 };
 
-std::vector<float> thetas, rhos;
+struct Ellipse {
+  cv::Point2i center;
+  int a = 0, b = 0;   // half major and minor axes
+  float angle = 0.f;  // of the major axis, radians
+};
+
+// Occurrence of a template found by the generalized transform.
+struct ShapeMatch {
+  cv::Point2i position; // of the template reference point
+  float angle = 0.f;    // radians
+  float scale = 1.f;
+  float votes = 0.f;
+};
+
+struct HoughResult {
+  cv::Mat img, flt, edg, acc, shapes;
+};
+
+enum LineEngine {
+  EXHAUSTIVE,  // every edge pixel votes, then the accumulator is thresholded
+  PROGRESSIVE, // random edge pixels vote until a bin is significant
+  KERNEL       // collinear clusters of chained edges vote a gaussian kernel
+};
+
+struct HoughLinesParams {
+  float theta_step = 1.f; // degrees
+  float rho_step = 1.f;   // pixels
+  int threads = 0;        // 0 : one per core
+  LineEngine engine = EXHAUSTIVE;
+  int votes_thresh = 50;  // progressive : votes for a bin to be significant
+  bool segments = false;  // exhaustive : split the lines in segments
+  int min_length = 30;    // segments : shortest segment kept (pixels)
+  int max_gap = 5;        // segments : longest hole inside a segment
+  int corridor = 2;       // progressive : pixels on each side of a segment taken
+                          // with it, edges being several pixels thick
+  float dir_window = -1;  // degrees voted on each side of the gradient
+                          // direction, < 0 : derived from the kernel
+  int peak_radius = 2;    // half size of the non-maximum suppression window
+  int top_k = 0;          // strongest lines kept, 0 : all
+  int pyramid = 0;        // detect on an image downsampled 2^pyramid times,
+                          // then refine at full resolution. 0 : off
+  float cluster_tolerance = 1.5f; // kernel : deviation splitting a chain (pixels)
+  int min_cluster = 10;   // kernel : smallest cluster voting (pixels)
+  int dir_bins = DIR_BINS; // gradient : direction bins over 360 degrees (at most 256)
+  bool thin = false;      // gradient : keep only the maxima across the edges
+  bool tiled = false;     // gradient, exhaustive : detect band by band without
+                          // full size intermediate images. Ignored, with a
+                          // warning, by the other engines, with a pyramid or
+                          // with bin_thresh 0
+};
+
+enum CircleEngine {
+  CUBE,      // (b, a, r) accumulator
+  TWO_STAGE, // 2D center accumulator, then one radius histogram per center,
+             // needs directions
+  RANDOMIZED // random samples of points vote in a hash map of circles
+};
+
+// Without directions, how a point finds the centers it votes for.
+enum CircleVoting {
+  SWEEP,  // every center of the bounding square, radius from the distance
+  RASTER  // midpoint circle of centers for each radius
+};
 
-int max_rho;
+struct HoughCirclesParams {
+  int threads = 0;        // 0 : one per core
+  CircleEngine engine = CUBE;
+  CircleVoting voting = SWEEP;
+  int min_radius = 1;     // pixels
+  int max_radius = 0;     // pixels, 0 : as large as the image allows
+  int peak_radius = 2;    // two stage : half size of the center suppression window
+  float min_coverage = 0.3f; // two stage, randomized : part of a circumference on edges
+  int iterations = 20000; // randomized : most samples drawn
+  int patience = 2000;    // randomized : samples without a new circle before stopping
+  int min_votes = 3;      // randomized : samples in a cell before it's checked
+  int cell_size = 2;      // randomized : quantization of centers and radii (pixels)
+  int pyramid = 0;        // detect on an image downsampled 2^pyramid times,
+                          // then refine at full resolution. 0 : off
+  int dir_bins = DIR_BINS; // gradient : direction bins over 360 degrees (at most 256)
+  bool thin = false;      // gradient : keep only the maxima across the edges
+  bool tiled = false;     // gradient, two stage : detect band by band without
+                          // full size intermediate images. Ignored, with a
+                          // warning, by the other engines, without directions
+                          // or with bin_thresh 0
+};
+
+struct HoughEllipsesParams {
+  int threads = 0;        // 0 : one per core
+  int min_axis = 5;       // pixels, shortest half axis
+  int max_axis = 0;       // pixels, longest half axis, 0 : as large as the image allows
+  float dir_tolerance = -1; // degrees between the tangents of a pair,
+                            // < 0 : derived from the kernel
+  int peak_radius = 2;    // half size of the center suppression window
+  float min_coverage = 0.3f; // part of a perimeter on edges
+  int max_pairs = 2048;   // partners sampled per point and orientation bucket,
+                          // 0 : all of them (quadratic in the bucket size)
+  int dir_bins = DIR_BINS; // gradient : direction bins over 360 degrees (at most 256)
+  bool thin = false;      // gradient : keep only the maxima across the edges
+};
+
+struct HoughShapesParams {
+  int threads = 0;        // 0 : one per core
+  int table_bins = 64;    // R-table orientation bins over 180 degrees
+  float dir_tolerance = -1; // degrees read on each side of an edge orientation,
+                            // < 0 : derived from the kernel
+  float min_angle = 0.f;  // degrees, rotations of the template searched
+  float max_angle = 0.f;
+  float angle_step = 10.f;
+  float min_scale = 1.f;  // scales of the template searched
+  float max_scale = 1.f;
+  float scale_step = 0.1f;
+  int cell_size = 2;      // pixels per accumulator cell
+  int peak_radius = 2;    // half size of the suppression window (cells)
+  int dir_bins = DIR_BINS; // gradient : direction bins over 360 degrees (at most 256)
+  bool thin = false;      // gradient : keep only the maxima across the edges
+};
+
+// cos/sin of every theta bin, divided by rho_step so that a dot product
+// directly gives a rho bin.
+struct TrigTable {
+  std::vector<float> cos_t, sin_t;
+};
+
+// Tables are built once per (theta step, rho step) and shared afterwards.
+// Both steps must be positive, theta_step at most 180 degrees.
+const TrigTable &trigTable(float theta_step, float rho_step) {
+  assert(theta_step > 0 && theta_step <= 180 && rho_step > 0);
+  static std::map<std::pair<float, float>, TrigTable> tables;
+  static std::mutex mutex;
+
+  std::unique_lock lock(mutex);
+  TrigTable &table = tables[{theta_step, rho_step}];
+  if (table.cos_t.empty()) {
+    int n_theta = cvRound(180.f / theta_step);
+    table.cos_t.resize(n_theta);
+    table.sin_t.resize(n_theta);
+    for (int t = 0; t < n_theta; ++t) {
+      table.cos_t[t] = cos(radians(t * theta_step)) / rho_step;
+      table.sin_t[t] = sin(radians(t * theta_step)) / rho_step;
+    }
+  }
+  return table;
+}
+
+// Geometry of a theta x rho accumulator.
+// Rows are theta bins, columns are rho bins shifted by rho_offset.
+struct LineSpace {
+  float theta_step = 1.f;
+  float rho_step = 1.f;
+  int n_theta = 0;
+  int n_rho = 0;
+  int rho_offset = 0;
+  const TrigTable *trig = nullptr;
+
+  LineSpace() {}
+
+  LineSpace(int cols, int rows, HoughLinesParams const &params)
+      : theta_step(params.theta_step), rho_step(params.rho_step) {
+    assert(theta_step > 0 && rho_step > 0);
+    float max_rho = sqrt(cols * cols + rows * rows);
+    trig = &trigTable(theta_step, rho_step);
+    n_theta = trig->cos_t.size();
+    rho_offset = std::ceil(max_rho / rho_step);
+    n_rho = 2 * rho_offset + 1;
+  }
+
+  float theta(float t) const { return radians(t * theta_step); }
+
+  float rho(float r) const { return (r - rho_offset) * rho_step; }
+};
 
 bool withinMat(int x, int y, int cols, int rows) 
 {
@@ -28,289 +207,612 @@ bool within3DMat(int a, int b, int r, int aSize, int bSize, int rSize)
   return a >= 0 && a < aSize && b >= 0 && b < bSize && r >= 0 && r < rSize;
 }
 
+const int VOTE_BLOCK = 256;
+
+// Votes a block of edge points in every theta row.
+// The rho bins of the whole block are computed first so that this loop
+// vectorizes, then they are scattered into the row which stays in cache.
+void voteLinesBlock(cv::Mat &acc, LineSpace const &space, const int *xs,
+                    const int *ys, int n) {
+  int bins[VOTE_BLOCK];
+  // rho_offset makes every value positive, so truncation rounds
+  float offset = space.rho_offset + 0.5f;
+  for (int t = 0; t < space.n_theta; ++t) {
+    float c = space.trig->cos_t[t];
+    float s = space.trig->sin_t[t];
+    for (int i = 0; i < n; ++i) {
+      bins[i] = int(xs[i] * c + ys[i] * s + offset);
+    }
+    float *row = acc.ptr<float>(t);
+    for (int i = 0; i < n; ++i) {
+      row[bins[i]] += 1.f;
+    }
+  }
+}
 
-void houghLines(cv::Mat bin, cv::Mat &acc, uchar thresh = 170) {
-  int max_theta = 180;
-  max_rho = std::ceil(sqrt(bin.cols * bin.cols + bin.rows * bin.rows));
-
-  acc = cv::Mat::zeros(max_theta, 2 * max_rho, CV_32F);
+void voteLines(cv::Mat &acc, LineSpace const &space, const int *xs,
+               const int *ys, int n) {
+  for (int i = 0; i < n; i += VOTE_BLOCK) {
+    voteLinesBlock(acc, space, xs + i, ys + i, std::min(VOTE_BLOCK, n - i));
+  }
+}
 
-  for (int y = 0; y < bin.rows; y++) {
-    for (int x = 0; x < bin.cols; x++) {
-      if (bin.at<uchar>(y, x) < thresh)
-        continue;
+// Bin of a gradient direction, folded in [0, 180) degrees.
+// The bin n_theta wraps to 0 : same line, opposite rho.
+int thetaBin(float theta, LineSpace const &space) {
+  if (theta < 0)
+    theta += M_PI;
+  else if (theta >= M_PI)
+    theta -= M_PI;
 
-      for (int t = 0; t < max_theta; ++t) {
-        float theta = radians(t);
-        int rho = int(x * cos(theta) + y * sin(theta));
+  int t = int(theta / radians(space.theta_step) + 0.5f);
+  return t >= space.n_theta ? t - space.n_theta : t;
+}
 
-        int r = rho + max_rho;
+// Votes of each edge point in the theta bins within window bins of its
+// gradient direction, dirs being bins of the table bins. window = 0 casts a
+// single vote.
+void voteLinesDirs(cv::Mat &acc, LineSpace const &space, const int *xs,
+                   const int *ys, const uchar *dirs, DirectionBins const &bins,
+                   int n, int window = 0) {
+  // theta bin of each direction bin
+  std::vector<int> theta_of(bins.n);
+  for (int d = 0; d < bins.n; ++d) {
+    theta_of[d] = thetaBin(bins.angle[d], space);
+  }
 
-        // range of rho mapped from -max_rho : max_rho to 0 : 2max_rho
-        acc.at<float>(t, r) += 1.;
-      }
+  float offset = space.rho_offset + 0.5f;
+  for (int i = 0; i < n; ++i) {
+    int t0 = theta_of[dirs[i]];
+    for (int dt = -window; dt <= window; ++dt) {
+      // rho is computed with the bin's own angle, so wrapping needs no flip
+      int t = (t0 + dt + space.n_theta) % space.n_theta;
+      int r = int(xs[i] * space.trig->cos_t[t] + ys[i] * space.trig->sin_t[t] + offset);
+      acc.at<float>(t, r) += 1.;
     }
   }
 }
-void houghLines(cv::Mat bin, cv::Mat &acc, cv::Mat &dirs, uchar thresh = 170) {
-  int max_theta = 180;
-  max_rho = std::ceil(sqrt(bin.cols * bin.cols + bin.rows * bin.rows));
-
-  acc = cv::Mat::zeros(max_theta + 1, 2 * max_rho, CV_32F);
 
-  for (int y = 0; y < bin.rows; y++) {
-    for (int x = 0; x < bin.cols; x++) {
-      if (bin.at<uchar>(y, x) < thresh)
-        continue;
+// Half width of the voting window, in theta bins. At most (n_theta - 1) / 2 :
+// a wider window would reach the same bin from both sides and vote it twice.
+int windowBins(float dir_window, LineSpace const &space) {
+  return std::min(int(dir_window / space.theta_step + 0.5f), (space.n_theta - 1) / 2);
+}
 
-      float theta = dirs.at<float>(y, x);
+// Votes every point in every theta bin, or only around its direction if
+// use_dirs is set and the points have directions (dir_window degrees on each
+// side, 0 for a single vote).
+void houghLines(EdgePoints const &pts, cv::Mat &acc, LineSpace const &space,
+                bool use_dirs = false, float dir_window = 0.f) {
+  acc = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+
+  if (use_dirs && !pts.dir.empty()) {
+    voteLinesDirs(acc, space, pts.x.data(), pts.y.data(), pts.dir.data(), pts.bins(),
+                  pts.size(), windowBins(dir_window, space));
+  } else {
+    voteLines(acc, space, pts.x.data(), pts.y.data(), pts.size());
+  }
+}
 
-      if (theta < 0)
-        theta = radians(180) + theta;
-      else if (theta > radians(180))
-        theta = theta - radians(180);
+void houghLines(cv::Mat bin, cv::Mat &acc, LineSpace const &space,
+                uchar thresh = 170) {
+  EdgePoints pts;
+  extractEdges(bin, thresh, pts);
+  houghLines(pts, acc, space);
+}
 
-      int rho = int(x * cos(theta) + y * sin(theta));
+void houghLines(cv::Mat bin, cv::Mat &acc, cv::Mat &dirs,
+                LineSpace const &space, uchar thresh = 170) {
+  EdgePoints pts;
+  extractEdges(bin, thresh, pts, dirs);
+  houghLines(pts, acc, space, true);
+}
 
-      int r = rho + max_rho;
-      // range of rho mapped from -max_rho : max_rho to 0 : 2max_rho
-      acc.at<float>(degrees(theta), r) += 1.;
-    }
+// Votes the centers at distance [min_r, max_r] of (x, y) along the unit
+// direction (cos_d, sin_d), only in the rows [row0, row1) of acc.
+void incLineDir(cv::Mat &acc, float cos_d, float sin_d, int x, int y, int max_a,
+                int max_b, int dir = 1, int min_r = 1, int max_r = INT_MAX,
+                int row0 = 0, int row1 = INT_MAX) {
+  float c = dir * cos_d;
+  float s = dir * sin_d;
+
+  // Radii whose row may fall in [row0, row1), with one row of margin for
+  // the truncation.
+  int r0 = min_r, r1 = max_r;
+  if (std::abs(s) > 1e-6f) {
+    float t0 = (row0 - 1 - y) / s;
+    float t1 = (std::min(row1, max_b) + 1 - y) / s;
+    r0 = std::max(r0, int(std::floor(std::min(t0, t1))));
+    r1 = std::min(r1, int(std::ceil(std::max(t0, t1))));
+  } else if (y < row0 || y >= row1) {
+    return;
   }
-}
 
-void houghCircles(cv::Mat bin, cv::Mat &acc, uchar th) {
-  // a, b, r
+  for (int r = r0; r <= r1; ++r) {
+    int a = x + r * c;
+    int b = y + r * s;
 
-  int max_r = std::min(bin.cols, bin.rows);
-  int max_a = bin.cols;
-  int max_b = bin.rows;
+    if (!withinMat(a, b, max_a, max_b))
+      break;
+    if (b >= row0 && b < row1)
+      acc.at<float>(b, a, r - min_r) += 1;
+  }
+}
 
-  int sizes[]{max_a, max_b, max_r};
+// Radii voted : [min_radius, max_radius] clamped to [1, limit - 1],
+// max_radius <= 0 meaning up to the limit.
+void radiusRange(int min_radius, int max_radius, int limit, int &min_r,
+                 int &max_r) {
+  max_r = max_radius > 0 ? std::min(max_radius, limit - 1) : limit - 1;
+  min_r = std::clamp(min_radius, 1, std::max(1, max_r));
+}
 
-  acc = cv::Mat::zeros(3, sizes, CV_32F);
+// Radius range of a circle accumulator : up to the diagonal along the
+// gradient lines, up to the smallest side otherwise.
+void circleRange(EdgePoints const &pts, bool use_dirs, int min_radius,
+                 int max_radius, int &min_r, int &max_r) {
+  int limit = use_dirs ? int(sqrt(pts.rows * pts.rows + pts.cols * pts.cols))
+                       : std::min(pts.cols, pts.rows);
+  radiusRange(min_radius, max_radius, limit, min_r, max_r);
+}
 
-  for (int y = 0; y < bin.rows; y++) {
-    for (int x = 0; x < bin.cols; x++) {
-      if (bin.at<uchar>(y, x) < th)
-        continue;
+// Votes every point in the rows [row0, row1) of acc. Rows are independent :
+// threads voting disjoint rows don't need any synchronisation.
+void voteCircles(cv::Mat &acc, EdgePoints const &pts, bool use_dirs, int min_r,
+                 int max_r, int row0, int row1) {
+  int max_a = pts.cols;
+  int max_b = pts.rows;
+
+  if (use_dirs) {
+    DirectionBins const &bins = pts.bins();
+    for (int i = 0; i < pts.size(); i++) {
+      float c = bins.cos_d[pts.dir[i]], s = bins.sin_d[pts.dir[i]];
+      incLineDir(acc, c, s, pts.x[i], pts.y[i], max_a, max_b, 1, min_r, max_r, row0, row1);
+      incLineDir(acc, c, s, pts.x[i], pts.y[i], max_a, max_b, -1, min_r, max_r, row0, row1);
+    }
+    return;
+  }
 
-      for (int a = 0; a < max_a; a++) {
-        for (int b = 0; b < max_b; b++) {
-          float da = a - x;
-          float db = b - y;
-          // Calculer directement r
-          float r = sqrt(da * da + db * db);
-          acc.at<float>(a, b, r) += 1;
-        }
+  // (max_r + 1)^2 : first squared distance truncated to a radius > max_r
+  int outer = (max_r + 1) * (max_r + 1);
+  for (int i = 0; i < pts.size(); i++) {
+    int x = pts.x[i];
+    int y = pts.y[i];
+
+    // Centers are within max_r of the point : only its bounding square
+    // is visited.
+    int b0 = std::max(row0, y - max_r), b1 = std::min(row1 - 1, y + max_r);
+    for (int b = b0; b <= b1; b++) {
+      float db = b - y;
+      int half = sqrt(outer - db * db);
+      int a0 = std::max(0, x - half), a1 = std::min(max_a - 1, x + half);
+      for (int a = a0; a <= a1; a++) {
+        float da = a - x;
+        // Calculer directement r
+        int r = sqrt(da * da + db * db);
+        if (r >= min_r && r <= max_r)
+          acc.at<float>(b, a, r - min_r) += 1;
       }
     }
   }
 }
-void incLineDir(cv::Mat &acc, float theta, int x, int y, int max_a, int max_b,
-                int dir = 1) {
-  int r = 1, a, b;
-  do {
-    a = x + dir * r * cos(theta);
-    b = y + dir * r * sin(theta);
 
-    if (withinMat(a, b, max_a, max_b)) {
-      acc.at<float>(b, a, r) += 1;
-    } else
-      break;
-    ++r;
-  } while (true);
+// Offsets of the pixels of the midpoint circle of each radius in
+// [min_r, max_r], at index r - min_r.
+std::vector<std::vector<cv::Point>> circleOffsets(int min_r, int max_r) {
+  std::vector<std::vector<cv::Point>> offsets(max_r - min_r + 1);
+  for (int r = min_r; r <= max_r; ++r) {
+    auto &circle = offsets[r - min_r];
+    int dx = r, dy = 0, err = 1 - r;
+    while (dx >= dy) {
+      // the 8 symmetric pixels of the first octant one
+      for (cv::Point p : {cv::Point(dx, dy), cv::Point(dy, dx)}) {
+        circle.push_back({p.x, p.y});
+        circle.push_back({-p.x, p.y});
+        circle.push_back({p.x, -p.y});
+        circle.push_back({-p.x, -p.y});
+      }
+      ++dy;
+      if (err < 0) {
+        err += 2 * dy + 1;
+      } else {
+        --dx;
+        err += 2 * (dy - dx) + 1;
+      }
+    }
+    // axes and diagonals were generated more than once
+    auto before = [](cv::Point p, cv::Point q) { return p.y < q.y || (p.y == q.y && p.x < q.x); };
+    std::sort(circle.begin(), circle.end(), before);
+    circle.erase(std::unique(circle.begin(), circle.end()), circle.end());
+  }
+  return offsets;
 }
 
-void houghCircles(cv::Mat bin, cv::Mat &acc, cv::Mat const &dirs,
-                          uchar th) {
-
-  int max_r = sqrt(bin.rows * bin.rows + bin.cols * bin.cols);
-  int max_a = bin.cols;
-  int max_b = bin.rows;
-
-  int sizes[]{max_b, max_a, max_r};
+// Votes every point for the radii [r0, r1] : the centers at distance r of a
+// point are the pixels of the midpoint circle of radius r around it. Radii
+// are independent : threads voting disjoint radii don't need any
+// synchronisation.
+void voteCirclesRaster(cv::Mat &acc, EdgePoints const &pts,
+                       std::vector<std::vector<cv::Point>> const &offsets,
+                       int min_r, int r0, int r1) {
+  int max_a = pts.cols;
+  int max_b = pts.rows;
+  for (int r = r0; r <= r1; ++r) {
+    auto const &circle = offsets[r - min_r];
+    for (int i = 0; i < pts.size(); i++) {
+      int x = pts.x[i];
+      int y = pts.y[i];
+      // whole circle inside : no bound checks
+      bool inside = x >= r && y >= r && x + r < max_a && y + r < max_b;
+      for (cv::Point d : circle) {
+        int a = x + d.x;
+        int b = y + d.y;
+        if (inside || withinMat(a, b, max_a, max_b))
+          acc.at<float>(b, a, r - min_r) += 1;
+      }
+    }
+  }
+}
 
+// Accumulator layout is (b, a, r - min_r) : center row, center column,
+// radius. Only the radii in [min_radius, max_radius] are allocated and voted,
+// max_radius <= 0 meaning as large as the image allows. Returns min_r.
+// With use_dirs, each point only votes along its gradient line. Otherwise,
+// voting chooses between the sweep of the bounding square of the centers and
+// the rasterization of one circle of centers per radius.
+int houghCircles(EdgePoints const &pts, cv::Mat &acc, bool use_dirs = false,
+                 int min_radius = 1, int max_radius = 0,
+                 CircleVoting voting = SWEEP) {
+  use_dirs = use_dirs && !pts.dir.empty();
+  int min_r, max_r;
+  circleRange(pts, use_dirs, min_radius, max_radius, min_r, max_r);
+
+  int sizes[]{pts.rows, pts.cols, max_r - min_r + 1};
   acc = cv::Mat::zeros(3, sizes, CV_32F);
 
-  for (int y = 0; y < bin.rows; y++) {
-    for (int x = 0; x < bin.cols; x++) {
-      if (bin.at<uchar>(y, x) < th)
-        continue;
+  if (!use_dirs && voting == RASTER) {
+    voteCirclesRaster(acc, pts, circleOffsets(min_r, max_r), min_r, min_r, max_r);
+  } else {
+    voteCircles(acc, pts, use_dirs, min_r, max_r, 0, pts.rows);
+  }
+  return min_r;
+}
 
-      float theta = dirs.at<float>(y, x);
+void houghCircles(cv::Mat bin, cv::Mat &acc, uchar th) {
+  EdgePoints pts;
+  extractEdges(bin, th, pts);
+  houghCircles(pts, acc);
+}
 
-      incLineDir(acc, theta, x, y, max_a, max_b);
-      incLineDir(acc, theta, x, y, max_a, max_b, -1);
-    }
-  }
+void houghCircles(cv::Mat bin, cv::Mat &acc, cv::Mat const &dirs,
+                          uchar th) {
+  EdgePoints pts;
+  extractEdges(bin, th, pts, dirs);
+  houghCircles(pts, acc, true);
 }
 
-void max3DMat(cv::Mat const& mat, double& max)
-{
-  assert(mat.dims == 3);
-  int aSize = mat.size[1];
-  int bSize = mat.size[0];
-  int rSize = mat.size[2];
-
-  max = 0;
-  for (int a = 0; a < aSize; ++a) {
-    for (int b = 0; b < bSize; ++b) {
-      for (int r = 0; r < rSize; ++r) {
-        if (mat.at<float>(b,a,r) > max) {
-          max = mat.at<float>(b,a,r);
-        }
+// Maximum of each center row b of a (b, a, r) accumulator. Rows are read in
+// memory order and split between nb_threads threads.
+std::vector<float> rowMaxima3D(cv::Mat const &acc, int nb_threads) {
+  int rows = acc.size[0];
+  size_t row_size = size_t(acc.size[1]) * acc.size[2];
+  std::vector<float> maxima(rows, 0.f);
+  parallelFor(0, rows, nb_threads, [&](int first, int last, int) {
+    for (int b = first; b < last; ++b) {
+      const float *cell = acc.ptr<float>(b);
+      float max = 0.f;
+      for (size_t k = 0; k < row_size; ++k) {
+        max = std::max(max, cell[k]);
       }
+      maxima[b] = max;
     }
-  }
+  });
+  return maxima;
 }
 
-void colorPixel3DRegion(
-  cv::Mat &bin, std::stack<cv::Point3f> &stack, int thresh, int a, int b, int r
-) {
-  assert(bin.dims == 3);
-  int aSize = bin.size[1];
-  int bSize = bin.size[0];
-  int rSize = bin.size[2];
-  bin.at<float>(b,a,r) = 0;
-
-  std::vector<cv::Point3f> neighbors = {
-      {a - 1, b, r}, {a + 1, b, r}, 
-      {a, b - 1, r}, {a, b + 1, r},
-      {a, b, r - 1}, {a, b, r + 1}
-  };
-  for (auto neigh : neighbors) {
-    if (within3DMat(neigh.x, neigh.y, neigh.z, aSize, bSize, rSize)) {
-      if (bin.at<float>(neigh.y, neigh.x, neigh.z) > thresh) {
-        bin.at<float>(neigh.y, neigh.x, neigh.z) = 0;
-        stack.push({neigh.x, neigh.y, neigh.z});
+// Whether (b, a, r) is the maximum of its 3x3x3 neighbourhood. On plateaus,
+// only the first cell in memory order is kept.
+bool isCirclePeak(cv::Mat const &acc, int b, int a, int r) {
+  const float *cell = acc.ptr<float>(b, a) + r;
+  float val = *cell;
+  size_t step_a = acc.size[2];
+  size_t step_b = size_t(acc.size[1]) * acc.size[2];
+  for (int db = -1; db <= 1; ++db) {
+    for (int da = -1; da <= 1; ++da) {
+      for (int dr = -1; dr <= 1; ++dr) {
+        if (!within3DMat(a + da, b + db, r + dr, acc.size[1], acc.size[0], acc.size[2]))
+          continue;
+        long offset = db * long(step_b) + da * long(step_a) + dr;
+        if (offset == 0)
+          continue;
+        float other = cell[offset];
+        if (offset < 0 ? other >= val : other > val)
+          return false;
       }
     }
   }
+  return true;
 }
 
-
+// Peaks of a (b, a, r - min_radius) accumulator : cells above
+// circle_thresh * max that are the maximum of their 3x3x3 neighbourhood,
+// refined by the barycenter of the peak and the neighbours above
+// grouping_thresh * max.
+// Center rows are split between nb_threads threads (<= 0 : one per core).
 std::vector<Circle> getCircles(
-  const cv::Mat &bin, float circle_thresh, float grouping_thresh
+  const cv::Mat &bin, float circle_thresh, float grouping_thresh, int min_radius = 1,
+  int nb_threads = 1
 ) {
   assert(bin.dims == 3);
   int aSize = bin.size[1];
   int bSize = bin.size[0];
   int rSize = bin.size[2];
 
-  cv::Mat tmp = bin.clone();
+  if (nb_threads <= 0)
+    nb_threads = hardwareThreads();
+  nb_threads = std::max(1, std::min(nb_threads, bSize));
 
-  std::vector<Circle> circles;
-
-  double max;
-  max3DMat(bin, max);
-
-  for (int b = 0; b < bSize; b++) {
-    for (int a = 0; a < aSize; a++) {
-      for (int r = 0; r < rSize; r++) {
-        if (tmp.at<float>(b,a,r) < circle_thresh*max)
-          continue;
-        std::stack<cv::Point3f> stack;
-      
-        stack.push({a, b, r});
-        Circle circle;
-        cv::Point3f barycenter = {0.f, 0.f, 0.f};
-        int count = 0;
+  // rows whose maximum is below the threshold are skipped as a whole
+  auto maxima = rowMaxima3D(bin, nb_threads);
+  float max = maxima.empty() ? 0.f : *std::max_element(maxima.begin(), maxima.end());
+  float peak_thresh = std::max(circle_thresh * max, 1e-6f);
+  float group_thresh = grouping_thresh * max;
 
-        while (!stack.empty()) {
-          cv::Point3f p = stack.top();
-          stack.pop();
-
-          barycenter += cv::Point3f(a, b, r);
-
-          colorPixel3DRegion(tmp, stack, grouping_thresh*max, p.x, p.y, p.z);
-
-          ++count;
+  std::vector<std::vector<Circle>> found(nb_threads);
+  parallelFor(0, bSize, nb_threads, [&](int first, int last, int i) {
+    for (int b = first; b < last; b++) {
+      if (maxima[b] < peak_thresh)
+        continue;
+      for (int a = 0; a < aSize; a++) {
+        const float *votes = bin.ptr<float>(b, a);
+        for (int r = 0; r < rSize; r++) {
+          if (votes[r] < peak_thresh || !isCirclePeak(bin, b, a, r))
+            continue;
+
+          cv::Point3f barycenter = {0.f, 0.f, 0.f};
+          float weight = 0.f;
+          for (int db = -1; db <= 1; ++db) {
+            for (int da = -1; da <= 1; ++da) {
+              for (int dr = -1; dr <= 1; ++dr) {
+                if (!within3DMat(a + da, b + db, r + dr, aSize, bSize, rSize))
+                  continue;
+                float val = bin.at<float>(b + db, a + da, r + dr);
+                // the peak always counts : grouping_thresh may be above
+                // circle_thresh
+                if (val < group_thresh && (db || da || dr))
+                  continue;
+                barycenter += cv::Point3f(a + da, b + db, r + dr) * val;
+                weight += val;
+              }
+            }
+          }
+          barycenter /= weight;
+
+          Circle circle;
+          circle.center = {cvRound(barycenter.x), cvRound(barycenter.y)};
+          circle.radius = cvRound(barycenter.z) + min_radius;
+          found[i].push_back(circle);
         }
-
-        barycenter /= count;
-        circle.radius = barycenter.z;
-        circle.center = {barycenter.x, barycenter.y};
-        circles.push_back(circle);
       }
     }
-  }
+  });
 
+  std::vector<Circle> circles;
+  for (auto &part : found) {
+    circles.insert(circles.end(), part.begin(), part.end());
+  }
   return circles;
 }
 
-void colorPixelRegion(cv::Mat &bin, std::stack<cv::Point> &stack, int thresh,
-                      unsigned int x, unsigned int y) {
-  unsigned int rows = bin.rows;
-  unsigned int cols = bin.cols;
-  bin.at<float>(y, x) = 0;
+// Value of the accumulator cell (t, r) where t may leave [0, n_theta) :
+// theta - 180 is the same line with the opposite rho.
+float lineCell(const cv::Mat &acc, LineSpace const &space, int t, int r) {
+  if (t < 0 || t >= space.n_theta) {
+    t = (t + space.n_theta) % space.n_theta;
+    r = 2 * space.rho_offset - r;
+  }
+  if (r < 0 || r >= space.n_rho)
+    return 0;
+  return acc.at<float>(t, r);
+}
 
-  std::vector<cv::Point> neighbors = {
-      {x - 1, y}, {x + 1, y}, {x, y - 1}, {x, y + 1}};
-  for (auto neigh : neighbors) {
-    if (withinMat(neigh.x, neigh.y, cols, rows)) {
-      if (bin.at<float>(neigh.y, neigh.x) > thresh) {
-        bin.at<float>(neigh.y, neigh.x) = 0;
-        stack.push({neigh.x, neigh.y});
-      }
+// Whether (t, r) is the maximum of its window. On plateaus, only the first
+// cell in memory order is kept.
+bool isLinePeak(const cv::Mat &acc, LineSpace const &space, int t, int r,
+                int radius) {
+  float val = acc.at<float>(t, r);
+  for (int dt = -radius; dt <= radius; ++dt) {
+    for (int dr = -radius; dr <= radius; ++dr) {
+      float neigh = lineCell(acc, space, t + dt, r + dr);
+      bool before = dt < 0 || (dt == 0 && dr < 0);
+      if (neigh > val || (before && neigh == val))
+        return false;
     }
   }
+  return true;
 }
 
-std::vector<Line> getLines(const cv::Mat &bin, float th1 = 0.4f,
-                           float th2 = 0.05f) {
-  cv::Mat tmp = bin.clone();
-
-  std::vector<Line> lines;
-
+// Peaks of the accumulator : cells above th1 * max that are the maximum of
+// their (2 * radius + 1)^2 window, refined by the barycenter of the peak and
+// the window cells above th2 * max. Theta rows are split between nb_threads threads.
+// If top_k > 0, only the top_k strongest peaks are returned.
+std::vector<Line> getLines(const cv::Mat &bin, LineSpace const &space,
+                           float th1 = 0.4f, float th2 = 0.05f,
+                           int radius = 2, int top_k = 0, int nb_threads = 1) {
   double max;
-  cv::Point empty;
   cv::minMaxLoc(bin, nullptr, &max);
+  float peak_thresh = std::max(th1 * max, 1e-6);
+  float group_thresh = th2 * max;
+
+  if (nb_threads <= 0)
+    nb_threads = hardwareThreads();
+  nb_threads = std::max(1, std::min(nb_threads, bin.rows));
+  std::vector<std::vector<Line>> found(nb_threads);
+
+  parallelFor(0, bin.rows, nb_threads, [&](int first, int last, int i) {
+    for (int y = first; y < last; y++) {
+      const float *row = bin.ptr<float>(y);
+      for (int x = 0; x < bin.cols; x++) {
+        if (row[x] < peak_thresh || !isLinePeak(bin, space, y, x, radius))
+          continue;
 
-  for (int y = 0; y < tmp.rows; y++) {
-    for (int x = 0; x < tmp.cols; x++) {
-      if (tmp.at<float>(y, x) < th1 * max)
-        continue;
-      std::stack<cv::Point> stack;
-      stack.push({x, y});
-      Line line;
-      cv::Point2f barycenter = {0.f, 0.f};
-      int count = 0;
+        cv::Point2f barycenter = {0.f, 0.f};
+        float weight = 0.f;
+        for (int dt = -radius; dt <= radius; ++dt) {
+          for (int dr = -radius; dr <= radius; ++dr) {
+            float val = lineCell(bin, space, y + dt, x + dr);
+            // the peak always counts : th2 may be above th1
+            if (val < group_thresh && (dt || dr))
+              continue;
+            barycenter += cv::Point2f(x + dr, y + dt) * val;
+            weight += val;
+          }
+        }
+        barycenter /= weight;
+
+        Line line;
+        line.theta = space.theta(barycenter.y);
+        line.rho = space.rho(barycenter.x);
+        line.votes = row[x];
+        line.position_in_acc = {x, y};
+        found[i].push_back(line);
+      }
+    }
+  });
 
-      while (!stack.empty()) {
-        cv::Point p = stack.top();
-        stack.pop();
+  std::vector<Line> lines;
+  for (auto &part : found) {
+    lines.insert(lines.end(), part.begin(), part.end());
+  }
 
-        barycenter += cv::Point2f(p.x, p.y);
+  if (top_k > 0 && (int)lines.size() > top_k) {
+    std::stable_sort(lines.begin(), lines.end(), [](Line const &a, Line const &b) {
+      return a.votes > b.votes;
+    });
+    lines.resize(top_k);
+  }
 
-        colorPixelRegion(tmp, stack, th2 * max, p.x, p.y);
+  return lines;
+}
 
-        ++count;
+// Pixels of lns at 255 kept only where bin is 255 too, the others copied.
+void intersectImg(cv::Mat const &bin, cv::Mat const &lns, cv::Mat &dst,
+                  int nb_threads = 0) {
+  assert(bin.type() == CV_8UC1 && lns.type() == CV_8UC1);
+  assert(bin.size() == lns.size());
+  dst.create(lns.size(), CV_8UC1);
+  int cols = bin.cols;
+  parallelFor(0, bin.rows, nb_threads, [&](int first, int last, int) {
+    for (int r = first; r < last; ++r) {
+      const uchar *b = bin.ptr<uchar>(r);
+      const uchar *l = lns.ptr<uchar>(r);
+      uchar *out = dst.ptr<uchar>(r);
+      for (int c = 0; c < cols; ++c) {
+        out[c] = l[c] != 255 ? l[c] : (b[c] == 255 ? 255 : 0);
       }
+    }
+  });
+}
 
-      barycenter /= count;
-      line.theta = radians(barycenter.y);
-      line.rho = barycenter.x - max_rho;
-      line.position_in_acc = {barycenter.x, barycenter.y};
-      lines.push_back(line);
+// Range of t for which p + t * d stays inside [0, cols - 1] x [0, rows - 1].
+// Returns false if the line misses the image.
+bool clipLine(cv::Point2f p, cv::Point2f d, int cols, int rows, float &t0,
+              float &t1) {
+  t0 = -1e9f;
+  t1 = 1e9f;
+  float lows[] = {-p.x, -p.y};
+  float highs[] = {cols - 1 - p.x, rows - 1 - p.y};
+  float dirs[] = {d.x, d.y};
+  for (int k = 0; k < 2; ++k) {
+    if (std::abs(dirs[k]) < 1e-6f) {
+      if (lows[k] > 0 || highs[k] < 0)
+        return false;
+      continue;
     }
+    float a = lows[k] / dirs[k];
+    float b = highs[k] / dirs[k];
+    t0 = std::max(t0, std::min(a, b));
+    t1 = std::min(t1, std::max(a, b));
   }
+  return t0 <= t1;
+}
 
-  return lines;
+// Splits a line in the runs of edge pixels it crosses. A pixel counts as an
+// edge if an edge lies within tolerance pixels across the line, a run ends
+// after more than max_gap pixels without edge.
+void lineSegments(Line const &line, cv::Mat const &bin, uchar thresh,
+                  int min_length, int max_gap, int tolerance,
+                  std::vector<Segment> &segments) {
+  cv::Point2f p(line.rho * cos(line.theta), line.rho * sin(line.theta));
+  cv::Point2f d(-sin(line.theta), cos(line.theta));
+  float t0, t1;
+  if (!clipLine(p, d, bin.cols, bin.rows, t0, t1))
+    return;
+
+  // one pixel along the major axis per step, tolerance along the minor one
+  float norm = std::max(std::abs(d.x), std::abs(d.y));
+  cv::Point2f step = d / norm;
+  cv::Point across = std::abs(d.x) > std::abs(d.y) ? cv::Point(0, 1) : cv::Point(1, 0);
+  cv::Point2f start = p + d * t0;
+  int steps = int((t1 - t0) * norm);
+
+  Segment run;
+  run.line = line;
+  int gap = 0;
+  bool open = false;
+  auto close = [&]() {
+    cv::Point v = run.p2 - run.p1;
+    if (open && std::hypot(v.x, v.y) >= min_length)
+      segments.push_back(run);
+    open = false;
+  };
+
+  for (int k = 0; k <= steps; ++k) {
+    cv::Point px(cvRound(start.x + k * step.x), cvRound(start.y + k * step.y));
+    bool edge = false;
+    for (int o = -tolerance; o <= tolerance && !edge; ++o) {
+      cv::Point q = px + across * o;
+      edge = withinMat(q.x, q.y, bin.cols, bin.rows) &&
+             bin.ptr<uchar>(q.y)[q.x] >= thresh;
+    }
+
+    if (edge) {
+      if (!open) {
+        run.p1 = px;
+        run.support = 0;
+        open = true;
+      }
+      run.p2 = px;
+      ++run.support;
+      gap = 0;
+    } else if (open && ++gap > max_gap) {
+      close();
+    }
+  }
+  close();
 }
 
-void intersectImg(cv::Mat const &bin, cv::Mat const &lns, cv::Mat &dst) {
-  assert(bin.type() == lns.type());
-  dst = lns.clone();
-  int rows = bin.rows;
-  int cols = bin.cols;
-  for (int r = 0; r < rows; ++r) {
-    for (int c = 0; c < cols; ++c) {
-      if (dst.at<uchar>(r, c) != 255)
-        continue;
-      dst.at<uchar>(r, c) = (bin.at<uchar>(r, c) == 255) ? 255 : 0;
+// Supporting segments of the detected lines, lines split between threads.
+std::vector<Segment> extractSegments(std::vector<Line> const &lines,
+                                     cv::Mat const &bin, uchar thresh,
+                                     int min_length, int max_gap,
+                                     int tolerance = 1, int nb_threads = 0) {
+  if (nb_threads <= 0)
+    nb_threads = hardwareThreads();
+  nb_threads = std::max(1, std::min<int>(nb_threads, lines.size()));
+  std::vector<std::vector<Segment>> found(nb_threads);
+
+  parallelFor(0, lines.size(), nb_threads, [&](int first, int last, int i) {
+    for (int l = first; l < last; ++l) {
+      lineSegments(lines[l], bin, thresh, min_length, max_gap, tolerance, found[i]);
     }
+  });
+
+  std::vector<Segment> segments;
+  for (auto &part : found) {
+    segments.insert(segments.end(), part.begin(), part.end());
   }
+  return segments;
 }
 
 void drawLocalExtrema(const std::vector<Line> &lines, cv::Mat &out) {
@@ -340,6 +842,12 @@ void drawLines(const std::vector<Line> &lines, cv::Mat &out, int thickness) {
   }
 }
 
+void drawSegments(const std::vector<Segment> &segments, cv::Mat &out, int thickness) {
+  for (auto &segment : segments) {
+    cv::line(out, segment.p1, segment.p2, {255, 0, 0}, thickness);
+  }
+}
+
 void drawCircles(std::vector<Circle> circles, cv::Mat & out, int thickness) 
 {
   assert(out.type() == CV_8UC3);
@@ -348,3 +856,31 @@ void drawCircles(std::vector<Circle> circles, cv::Mat & out, int thickness)
     cv::drawMarker(out, circle.center, {255, 0, 0}, 1, 10);
   }
 }
+
+void drawEllipses(std::vector<Ellipse> ellipses, cv::Mat & out, int thickness) 
+{
+  assert(out.type() == CV_8UC3);
+  for (auto & ellipse : ellipses) {
+    cv::ellipse(out, ellipse.center, cv::Size(ellipse.a, ellipse.b), degrees(ellipse.angle),
+                0, 360, {255, 0, 0}, thickness);
+    cv::drawMarker(out, ellipse.center, {255, 0, 0}, 1, 10);
+  }
+}
+
+// Template edges outline, relative to its reference point, drawn at every
+// match.
+void drawShapes(std::vector<ShapeMatch> matches, std::vector<cv::Point2f> const &outline,
+                cv::Mat & out, int thickness)
+{
+  assert(out.type() == CV_8UC3);
+  for (auto & match : matches) {
+    float c = cos(match.angle) * match.scale;
+    float s = sin(match.angle) * match.scale;
+    for (auto & p : outline) {
+      cv::Point q(cvRound(match.position.x + p.x * c - p.y * s),
+                  cvRound(match.position.y + p.x * s + p.y * c));
+      cv::circle(out, q, thickness / 2, {255, 0, 0}, -1);
+    }
+    cv::drawMarker(out, match.position, {255, 0, 0}, 1, 10);
+  }
+}
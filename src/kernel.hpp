@@ -1,32 +1,153 @@
 #pragma once
 #include "opencv2/imgproc.hpp"
+#include <array>
+#include <cmath>
+#include <vector>
 
 namespace kernel
 {
-    const float prewitt[9] = {
+    constexpr float prewitt[9] = {
         -1.f/3, 0, 1.f/3,
         -1.f/3, 0, 1.f/3,
         -1.f/3, 0, 1.f/3
     };
 
-    const float sobel[9] = {
+    constexpr float sobel[9] = {
         -1.f/4, 0, 1.f/4,
         -2.f/4, 0, 2.f/4,
         -1.f/4, 0, 1.f/4
     };
 
-    const float kirsch[9] = {
+    constexpr float kirsch[9] = {
         -3.f/15, -3.f/15, 5.f/15,
         -3.f/15,  0,      5.f/15,
         -3.f/15, -3.f/15, 5.f/15
     };
 
-    const float gaussian[9] = {
+    constexpr float gaussian[9] = {
         1.f/16, 1.f/8, 1.f/16,
         1.f/8,  1.f/4, 1.f/8,
         1.f/16, 1.f/8, 1.f/16
     };
 
+    // Gradient kernels, in the order of the demos' trackbar : the 3x3 ones,
+    // then derivatives of Gaussian of larger support.
+    enum Gradient { PREWITT, SOBEL, KIRSCH, DOG5, DOG7, GRADIENT_COUNT };
+    const char* const GRADIENT_NAMES[GRADIENT_COUNT] = {
+        "prewitt", "sobel", "kirsch", "DoG 5x5", "DoG 7x7"
+    };
+    constexpr int GRADIENT_SIZES[GRADIENT_COUNT] = {3, 3, 3, 5, 7};
+    // coefficients of the 3x3 ones
+    constexpr const float* GRADIENTS[] = {prewitt, sobel, kirsch};
+
+    // Kernel col * row of odd sizes : row is applied along x, col along y.
+    struct Separable {
+        std::vector<float> row, col;
+
+        Separable transposed() const { return {col, row}; }
+    };
+
+    // Factors of h (CV_32F) if it is of rank 1, up to a relative error of
+    // 1e-5 : its column and its row through the largest coefficient.
+    bool separate(cv::Mat const& h, Separable& k)
+    {
+        int pr = 0, pc = 0;
+        float best = 0.f;
+        for (int r = 0; r < h.rows; ++r) {
+            for (int c = 0; c < h.cols; ++c) {
+                if (std::abs(h.at<float>(r, c)) > best) {
+                    best = std::abs(h.at<float>(r, c));
+                    pr = r;
+                    pc = c;
+                }
+            }
+        }
+        if (best == 0.f)
+            return false;
+
+        k.col.clear();
+        k.row.clear();
+        for (int r = 0; r < h.rows; ++r) {
+            k.col.push_back(h.at<float>(r, pc));
+        }
+        for (int c = 0; c < h.cols; ++c) {
+            k.row.push_back(h.at<float>(pr, c) / h.at<float>(pr, pc));
+        }
+        for (int r = 0; r < h.rows; ++r) {
+            for (int c = 0; c < h.cols; ++c) {
+                if (std::abs(h.at<float>(r, c) - k.col[r] * k.row[c]) > 1e-5f * best)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Gaussian of standard deviation sigma on size taps, of sum 1.
+    std::vector<float> gaussian1D(int size, float sigma)
+    {
+        std::vector<float> g(size);
+        float sum = 0.f;
+        for (int i = 0; i < size; ++i) {
+            float x = i - size / 2;
+            g[i] = std::exp(-x * x / (2 * sigma * sigma));
+            sum += g[i];
+        }
+        for (float& v : g) {
+            v /= sum;
+        }
+        return g;
+    }
+
+    // Derivative along x of a Gaussian on size x size taps (size odd),
+    // sigma = (size - 1) / 4 if not given. Scaled like the 3x3 kernels : the
+    // response to a step is its height.
+    Separable derivativeOfGaussian(int size, float sigma = 0.f)
+    {
+        assert(size % 2 == 1 && size >= 3);
+        if (sigma <= 0.f)
+            sigma = (size - 1) / 4.f;
+        Separable k;
+        k.col = gaussian1D(size, sigma);
+        float positive = 0.f;
+        for (int i = 0; i < size; ++i) {
+            float x = i - size / 2;
+            k.row.push_back(x * std::exp(-x * x / (2 * sigma * sigma)));
+            positive += std::max(0.f, k.row.back());
+        }
+        for (float& v : k.row) {
+            v /= positive;
+        }
+        return k;
+    }
+
+    // Border of a 3x3 kernel, clockwise from the top left corner.
+    constexpr int RING[8] = {0, 1, 2, 5, 8, 7, 6, 3};
+
+    // h turned by 45 degrees steps times, at compile time : the border
+    // shifts clockwise by one position per step, as rotate() does.
+    constexpr std::array<float, 9> rotated(const float* h, int steps)
+    {
+        std::array<float, 9> rt{};
+        rt[4] = h[4];
+        for (int i = 0; i < 8; ++i) {
+            rt[RING[(i + steps) % 8]] = h[RING[i]];
+        }
+        return rt;
+    }
+
+    // h (square, odd size) turned by 90 degrees, as rotate() twice on 3x3.
+    cv::Mat rotate90(cv::Mat const& h)
+    {
+        int n = h.rows;
+        cv::Mat rt(n, n, CV_32F);
+        for (int r = 0; r < n; ++r) {
+            for (int c = 0; c < n; ++c) {
+                rt.at<float>(r, c) = h.at<float>(n - 1 - c, r);
+            }
+        }
+        return rt;
+    }
+
     cv::Mat rotate(cv::Mat const& h)
     {
         cv::Mat rt = h.clone();
@@ -0,0 +1,169 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+
+// Kernel-based Hough transform
+// 1. edge pixels are linked in 8-connected chains
+// 2. chains are split until each piece is close to a straight segment
+// 3. each piece is fitted once and votes an oriented gaussian kernel, sized
+//    by the uncertainty of the fit, instead of one vote per pixel per theta
+// The number of votes goes from edges x n_theta to a few bins per cluster.
+
+// Offsets of the 8 neighbours, 4-connected ones first so that chains follow
+// the thinnest path.
+const int CHAIN_DX[8] = {1, 0, -1, 0, 1, -1, -1, 1};
+const int CHAIN_DY[8] = {0, 1, 0, -1, 1, 1, -1, -1};
+
+// Follows unvisited edge pixels from p, appending them to chain.
+void followChain(cv::Mat &mask, cv::Point p, std::vector<cv::Point> &chain) {
+  while (true) {
+    bool found = false;
+    for (int k = 0; k < 8 && !found; ++k) {
+      int x = p.x + CHAIN_DX[k];
+      int y = p.y + CHAIN_DY[k];
+      if (withinMat(x, y, mask.cols, mask.rows) && mask.at<uchar>(y, x) == 1) {
+        mask.at<uchar>(y, x) = 2;
+        p = {x, y};
+        chain.push_back(p);
+        found = true;
+      }
+    }
+    if (!found)
+      return;
+  }
+}
+
+// Largest distance of the chain points in [first, last] to the segment
+// joining them, and where it is reached.
+float chainDeviation(std::vector<cv::Point> const &chain, int first, int last,
+                     int &farthest) {
+  cv::Point2f a = chain[first];
+  cv::Point2f d = cv::Point2f(chain[last]) - a;
+  float length = std::hypot(d.x, d.y);
+
+  float max_dist = 0;
+  farthest = (first + last) / 2;
+  for (int k = first + 1; k < last; ++k) {
+    cv::Point2f v = cv::Point2f(chain[k]) - a;
+    // closed chains : distance to the first point
+    float dist = length > 0 ? std::abs(v.x * d.y - v.y * d.x) / length
+                            : std::hypot(v.x, v.y);
+    if (dist > max_dist) {
+      max_dist = dist;
+      farthest = k;
+    }
+  }
+  return max_dist;
+}
+
+// Fits the cluster [first, last] and adds its gaussian kernel to acc.
+void voteCluster(cv::Mat &acc, LineSpace const &space,
+                 std::vector<cv::Point> const &chain, int first, int last) {
+  int n = last - first + 1;
+  float mx = 0, my = 0;
+  for (int k = first; k <= last; ++k) {
+    mx += chain[k].x;
+    my += chain[k].y;
+  }
+  mx /= n;
+  my /= n;
+
+  float sxx = 0, syy = 0, sxy = 0;
+  for (int k = first; k <= last; ++k) {
+    float dx = chain[k].x - mx;
+    float dy = chain[k].y - my;
+    sxx += dx * dx;
+    syy += dy * dy;
+    sxy += dx * dy;
+  }
+  sxx /= n;
+  syy /= n;
+  sxy /= n;
+
+  // principal axes of the cluster, the normal is the minor one
+  float half_trace = (sxx + syy) / 2;
+  float delta = sqrt((sxx - syy) * (sxx - syy) / 4 + sxy * sxy);
+  float l_max = half_trace + delta;
+  float l_min = std::max(0.f, half_trace - delta);
+  float theta = 0.5f * atan2(2 * sxy, sxx - syy) + M_PI_2;
+  if (theta >= M_PI)
+    theta -= M_PI;
+
+  // standard errors of a least squares line, pixels add 1/12 of variance
+  float sigma = sqrt(l_min + 1.f / 12);
+  float theta_step = radians(space.theta_step);
+  float sigma_theta = std::max(sigma / std::sqrt(n * l_max + 1e-6f), theta_step / 2);
+  float sigma_rho = std::max(sigma / std::sqrt(float(n)), space.rho_step / 2);
+
+  int t0 = cvRound(theta / theta_step);
+  int dt_max = std::ceil(2 * sigma_theta / theta_step);
+  int dr_max = std::ceil(2 * sigma_rho / space.rho_step);
+  for (int dt = -dt_max; dt <= dt_max; ++dt) {
+    float e_theta = ((t0 + dt) * theta_step - theta) / sigma_theta;
+    float w_theta = n * exp(-0.5f * e_theta * e_theta);
+
+    // bin angle wraps, rho follows through the bin's own cos / sin
+    int t = ((t0 + dt) % space.n_theta + space.n_theta) % space.n_theta;
+    float rc = mx * space.trig->cos_t[t] + my * space.trig->sin_t[t] + space.rho_offset;
+    float *row = acc.ptr<float>(t);
+    for (int dr = -dr_max; dr <= dr_max; ++dr) {
+      int r = cvRound(rc) + dr;
+      if (r < 0 || r >= space.n_rho)
+        continue;
+      float e_rho = (r - rc) * space.rho_step / sigma_rho;
+      row[r] += w_theta * exp(-0.5f * e_rho * e_rho);
+    }
+  }
+}
+
+// Accumulator of the kernel-based transform. Chains are split while they
+// deviate more than tolerance pixels from a segment, pieces shorter than
+// min_cluster pixels don't vote. If clusters isn't null, it receives their
+// number.
+void kernelHoughLines(EdgePoints const &pts, cv::Mat &acc, LineSpace const &space,
+                      float tolerance = 1.5f, int min_cluster = 10,
+                      int *clusters = nullptr) {
+  acc = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+
+  cv::Mat mask = cv::Mat::zeros(pts.rows, pts.cols, CV_8UC1);
+  for (int i = 0; i < pts.size(); ++i) {
+    mask.at<uchar>(pts.y[i], pts.x[i]) = 1;
+  }
+
+  std::vector<cv::Point> chain, backward;
+  std::vector<std::pair<int, int>> pieces;
+  int count = 0;
+  for (int i = 0; i < pts.size(); ++i) {
+    cv::Point start(pts.x[i], pts.y[i]);
+    if (mask.at<uchar>(start.y, start.x) != 1)
+      continue;
+    mask.at<uchar>(start.y, start.x) = 2;
+
+    // walk both ways from start, the backward part is reversed in front
+    backward.clear();
+    followChain(mask, start, backward);
+    chain.assign(backward.rbegin(), backward.rend());
+    chain.push_back(start);
+    followChain(mask, start, chain);
+
+    pieces.assign(1, {0, int(chain.size()) - 1});
+    while (!pieces.empty()) {
+      auto [first, last] = pieces.back();
+      pieces.pop_back();
+      if (last - first + 1 < min_cluster)
+        continue;
+
+      int farthest;
+      if (chainDeviation(chain, first, last, farthest) > tolerance) {
+        pieces.push_back({first, farthest});
+        pieces.push_back({farthest, last});
+      } else {
+        voteCluster(acc, space, chain, first, last);
+        ++count;
+      }
+    }
+  }
+
+  if (clusters)
+    *clusters = count;
+}
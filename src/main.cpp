@@ -1,3 +1,4 @@
+#include "benchmark.hpp"
 #include "opencv2/imgcodecs.hpp"
 #include "ui.hpp"
 #include <cstdio>
@@ -28,10 +29,25 @@ int main(int argc, char **argv) {
   if (argc > 1) {
     std::string mode = argv[1];
 
+    if (mode.compare("bench") == 0)
+      return runBenchmarks(img, (argc > 3) ? argv[3] : "");
+
     if (mode.compare("lines") == 0)
       viewer = new DemoHoughLinesGrad(img);
     else if (mode.compare("circles") == 0)
       viewer = new DemoHoughCirclesGrad(img);
+    else if (mode.compare("ellipses") == 0)
+      viewer = new DemoHoughEllipsesGrad(img);
+    else if (mode.compare("shapes") == 0) {
+      cv::Mat tpl;
+      if (argc > 3)
+        tpl = cv::imread(argv[3]);
+      if (!tpl.data) {
+        std::cerr << "Usage : " << argv[0] << " shapes <filepath> <template>";
+        return -1;
+      }
+      viewer = new DemoHoughShapesGrad(img, tpl);
+    }
     else{
       std::cerr << "Invalid argument for viewer mode";
       return -1;
@@ -1,201 +1,144 @@
 #pragma once
-#include "applications.hpp"
 #include "gradient.hpp"
+#include "hough.hpp"
 #include "opencv2/imgproc.hpp"
 #include "utils.hpp"
-#include <mutex>
 #include <opencv2/core.hpp>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/highgui.hpp>
 #include <thread>
 
-// Hough lines from bin, multithreading
-// 1. divide the image by n*n squares
-// 2.
-
-struct MutexMatrix3D {
-  std::vector<std::mutex> pixelMutexes;
-  int size_a, size_b, size_c;
-
-  MutexMatrix3D(int size_a, int size_b, int size_c)
-      : size_a(size_a), size_b(size_b), size_c(size_c),
-        pixelMutexes(size_a * size_b * size_c) {}
-
-  std::mutex &get_mutex(int a, int b, int c) {
-    int index = a + b * size_a + c * size_a * size_b;
-    if (index > size_a * size_b * size_c || index < 0) {
-      std::cerr << std::endl << std::endl << "Invalid......." << std::endl;
-    }
-    return pixelMutexes[index];
-  }
-};
-
-struct ThreadStruct {
-  ThreadStruct(MutexMatrix3D &mut, cv::Mat acc, cv::Point range, int max_a,
-               int max_b)
-      : mutexes(mut), accumulator(acc), range_cols(range), max_a(max_a),
-        max_b(max_b) {}
-
-  MutexMatrix3D &mutexes;
-  cv::Mat accumulator;
-  cv::Point range_cols;
-  int max_a;
-  int max_b;
-};
-
-void circle_accumulator(ThreadStruct thread, const cv::Mat &bin,
-                        uchar binThresh) {
-  for (int y = 0; y < bin.rows; y++) {
-    for (int x = thread.range_cols.x; x < thread.range_cols.y; x++) {
-      if (bin.at<uchar>(y, x) < binThresh)
-        continue;
-
-      for (int a = 0; a < thread.max_a; a++) {
-        for (int b = 0; b < thread.max_b; b++) {
-          float da = a - x;
-          float db = b - y;
-          // Calculer directement r
-          float r = sqrt(da * da + db * db);
-
-          std::unique_lock lock(thread.mutexes.get_mutex(a, b, r));
-          thread.accumulator.at<float>(a, b, r) += 1;
+// Hough lines, multithreading
+// 1. split the edge points in one contiguous chunk per thread
+// 2. each thread votes in its own accumulator
+// 3. the accumulators are summed in thread order, row by row, so the result
+//    doesn't depend on the number of threads
+
+// Sums the partial accumulators into the first one.
+void reduceAccumulators(std::vector<cv::Mat> &partials, int nb_threads) {
+  int rows = partials[0].rows;
+  int cols = partials[0].cols;
+  parallelFor(0, rows, nb_threads, [&](int first, int last, int) {
+    for (int t = first; t < last; ++t) {
+      float *dst = partials[0].ptr<float>(t);
+      for (size_t k = 1; k < partials.size(); ++k) {
+        const float *src = partials[k].ptr<float>(t);
+        for (int r = 0; r < cols; ++r) {
+          dst[r] += src[r];
         }
       }
     }
-  }
+  });
 }
-//
-// void houghCircleDirection(ThreadStruct thread, const cv::Mat bin, cv::Mat
-// &acc, cv::Mat const &dirs,
-//                           uchar th) {
-//   for (int y = 0; y < bin.rows; y++) {
-//     for (int x = 0; x < bin.cols; x++) {
-//       if (bin.at<uchar>(y, x) < th)
-//         continue;
-//
-//       float theta = dirs.at<float>(y, x);
-//
-//       incLineDir(acc, theta, x, y, max_a, max_b);
-//       incLineDir(acc, theta, x, y, max_a, max_b, -1);
-//     }
-//   }
-// }
 
-HoughResult HoughCirclesFromBinMT(
-  const int nb_threads, const cv::Mat &img, int thickness, 
-  uchar binThresh, uchar circle_thresh, uchar grouping_thresh
-) {
-  HoughResult result;
+// Number of workers worth starting for n edge points.
+int lineWorkers(int nb_threads, int n) {
+  if (nb_threads <= 0)
+    nb_threads = hardwareThreads();
+  return std::max(1, std::min(nb_threads, n / VOTE_BLOCK));
+}
 
-  int offset = img.cols / nb_threads;
+void houghLinesMT(int nb_threads, EdgePoints const &pts, cv::Mat &acc,
+                  LineSpace const &space, bool use_dirs = false,
+                  float dir_window = 0.f) {
+  int n = pts.size();
+  nb_threads = lineWorkers(nb_threads, n);
+  std::vector<cv::Mat> partials(nb_threads);
+
+  parallelFor(0, n, nb_threads, [&](int first, int last, int i) {
+    partials[i] = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+    const int *xs = pts.x.data() + first;
+    const int *ys = pts.y.data() + first;
+    if (use_dirs && !pts.dir.empty()) {
+      voteLinesDirs(partials[i], space, xs, ys, pts.dir.data() + first, pts.bins(),
+                    last - first, windowBins(dir_window, space));
+    } else {
+      voteLines(partials[i], space, xs, ys, last - first);
+    }
+  });
 
-  int max_r = std::max(
-      img.cols,
-      std::max(img.rows, (int)sqrt(img.cols * img.cols + img.rows * img.rows)) +
-          1);
-  int max_a = img.cols;
-  int max_b = img.rows;
+  reduceAccumulators(partials, nb_threads);
+  acc = partials[0];
+}
 
-  int sizes[]{max_a, max_b, max_r};
+void houghLinesMT(int nb_threads, cv::Mat bin, cv::Mat &acc,
+                  LineSpace const &space, uchar thresh = 170) {
+  EdgePoints pts;
+  extractEdges(bin, thresh, pts);
+  houghLinesMT(nb_threads, pts, acc, space);
+}
 
-  cv::Mat accumulator = cv::Mat::zeros(3, sizes, CV_32F);
-  MutexMatrix3D mutexes = MutexMatrix3D(max_a, max_b, max_r);
+void houghLinesMT(int nb_threads, cv::Mat bin, cv::Mat &acc, cv::Mat &dirs,
+                  LineSpace const &space, uchar thresh = 170) {
+  EdgePoints pts;
+  extractEdges(bin, thresh, pts, dirs);
+  houghLinesMT(nb_threads, pts, acc, space, true);
+}
 
-  std::vector<std::thread> threads;
-  for (int i = 0; i < nb_threads; i++) {
-    int max_cols = offset * (i + 1) < img.cols ? offset * (i + 1) : img.cols;
+// Hough circles, multithreading
+// The accumulator is split in slabs of center rows, one per thread. Every
+// thread reads all the points but only votes in its own rows, so no cell is
+// shared and the result is the same as with one thread.
+// Rasterized voting splits the radii instead, in blocks of equal perimeter.
+
+// First radius of the block k / nb_blocks of [min_r, max_r] : sum of the
+// perimeters, i.e. r^2, is the same in every block.
+int radiusBlock(int k, int nb_blocks, int min_r, int max_r) {
+  float lo = float(min_r) * min_r;
+  float hi = float(max_r + 1) * (max_r + 1);
+  int r = cvRound(sqrt(lo + (hi - lo) * k / nb_blocks));
+  return std::clamp(r, min_r, max_r + 1);
+}
 
-    cv::Point range_cols = {offset * i, max_cols};
+// Same as houghCircles, on nb_threads threads (<= 0 : one per core).
+int houghCirclesMT(int nb_threads, EdgePoints const &pts, cv::Mat &acc,
+                   bool use_dirs = false, int min_radius = 1, int max_radius = 0,
+                   CircleVoting voting = SWEEP) {
+  use_dirs = use_dirs && !pts.dir.empty();
+  int min_r, max_r;
+  circleRange(pts, use_dirs, min_radius, max_radius, min_r, max_r);
+
+  int sizes[]{pts.rows, pts.cols, max_r - min_r + 1};
+  acc = cv::Mat::zeros(3, sizes, CV_32F);
+
+  if (!use_dirs && voting == RASTER) {
+    auto offsets = circleOffsets(min_r, max_r);
+    if (nb_threads <= 0)
+      nb_threads = hardwareThreads();
+    int nb_blocks = std::min(nb_threads, max_r - min_r + 1);
+    parallelFor(0, nb_blocks, nb_blocks, [&](int first, int last, int) {
+      for (int k = first; k < last; ++k) {
+        int r0 = radiusBlock(k, nb_blocks, min_r, max_r);
+        int r1 = radiusBlock(k + 1, nb_blocks, min_r, max_r) - 1;
+        voteCirclesRaster(acc, pts, offsets, min_r, r0, r1);
+      }
+    });
+    return min_r;
+  }
 
-    ThreadStruct data(std::ref(mutexes), accumulator, range_cols, max_a, max_b);
+  parallelFor(0, pts.rows, nb_threads, [&](int first, int last, int) {
+    voteCircles(acc, pts, use_dirs, min_r, max_r, first, last);
+  });
+  return min_r;
+}
 
-    threads.push_back(
-        std::thread([&]() { circle_accumulator(data, img, binThresh); }));
+HoughResult HoughCirclesFromBinMT(
+  const int nb_threads, const cv::Mat &img, int thickness, 
+  uchar binThresh, float circle_thresh, float grouping_thresh
+) {
+  HoughResult result;
 
-    std::cout << "Thread " << i << "started ! " << std::endl;
-  }
+  EdgePoints pts;
+  extractEdges(img, binThresh, pts);
 
-  for (int i = 0; i < nb_threads; i++) {
-    std::cout << "Thread " << i << "joined ! " << std::endl;
-    threads[i].join();
-  }
+  cv::Mat accumulator;
+  int min_r = houghCirclesMT(nb_threads, pts, accumulator);
 
   result.edg = img;
-  result.shapes = img;
+  result.shapes = img.clone();
 
-  auto circles = getCircles(accumulator, circle_thresh, grouping_thresh);
+  auto circles = getCircles(accumulator, circle_thresh, grouping_thresh, min_r, nb_threads);
   drawCircles(circles, result.shapes, thickness);
 
   return result;
 }
-//
-// HoughCirclesResult HoughCirclesFromGradMT(const int nb_threads, uchar sh,
-//                                           uchar sb, const cv::Mat &img,
-//                                           uchar binThresh, uchar
-//                                           circleThresh, Dimension dim =
-//                                           MULTI_DIM) {
-//   HoughCirclesResult result;
-//
-//   // ------------ grad ----------
-//   //
-//
-//   cv::Mat h(3, 3, CV_32F, const_cast<float *>(kernel::kirsch));
-//
-//   std::vector<cv::Mat> grads;
-//   grads = computeGradients(img, h, dim);
-//
-//   cv::Mat mags, uc_mags, dirs, fnl;
-//   if (dim == 2) {
-//     magnitudeBD(grads, mags, dirs);
-//   } else {
-//     magnitudeMD(grads, mags, dirs);
-//   }
-//
-//   double max;
-//   cv::minMaxLoc(mags, nullptr, &max);
-//   mags.convertTo(uc_mags, CV_8UC1);
-//   hysteresis(uc_mags, fnl, sh, sb);
-//
-//   //
-//   // ------------------------------
-//
-//   int offset = img.cols / nb_threads;
-//
-//   int max_r = std::min(img.cols, img.rows);
-//   int max_a = img.cols;
-//   int max_b = img.rows;
-//
-//   int sizes[]{max_a, max_b, max_r};
-//
-//   cv::Mat accumulator = cv::Mat::zeros(3, sizes, CV_32F);
-//   MutexMatrix3D mutexes = MutexMatrix3D(max_a, max_b, max_r);
-//
-//   std::vector<std::thread> threads;
-//   for (int i = 0; i < nb_threads; i++) {
-//     int max_cols = offset * (i + 1) < img.cols ? offset * (i + 1) : img.cols;
-//
-//     cv::Point range_cols = {offset * i, max_cols};
-//
-//     ThreadStruct data(std::ref(mutexes), accumulator, range_cols, max_b);
-//
-//     threads.push_back(
-//         std::thread([&]() { circle_accumulator(data, img, binThresh); }));
-//
-//     std::cout << "Thread " << i << "started ! " << std::endl;
-//   }
-//
-//   for (int i = 0; i < nb_threads; i++) {
-//     std::cout << "Thread " << i << "joined ! " << std::endl;
-//     threads[i].join();
-//   }
-//
-//   result.edges = fnl;
-//   result.circles = cv::Mat::zeros(img.size(), CV_8UC3);
-//
-//   // result.final = img;//cv::Mat::zeros(img.rows, img.cols, CV_8UC1);
-//   std::cout << "end" << std::endl;
-//
-//   drawCircles(img, result.circles, accumulator, circleThresh);
-//
-//   return result;
-// }
@@ -0,0 +1,164 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+#include <numeric>
+#include <random>
+
+// Progressive probabilistic Hough transform
+// 1. edge pixels vote one at a time, in random order
+// 2. as soon as the best bin of a pixel is significant, the line is followed
+//    from that pixel in both directions, over holes up to max_gap pixels
+// 3. if the segment is long enough, its pixels and those within corridor
+//    pixels across it leave the pool, and their votes are removed from the
+//    accumulator : the other pixels of a thick edge can't find it again
+// Most pixels of a long line are never voted, which is where the time goes.
+
+enum PoolState : uchar { REMOVED = 0, PENDING = 1, VOTED = 2 };
+
+// Adds (or removes with inc = -1) the votes of one pixel in every theta bin.
+// Returns the theta bin with the most votes.
+int voteLinePoint(cv::Mat &acc, LineSpace const &space, int x, int y,
+                  float inc, float *best = nullptr) {
+  float offset = space.rho_offset + 0.5f;
+  int best_t = 0;
+  float best_val = 0;
+  for (int t = 0; t < space.n_theta; ++t) {
+    int r = int(x * space.trig->cos_t[t] + y * space.trig->sin_t[t] + offset);
+    float &val = acc.at<float>(t, r);
+    val += inc;
+    if (val > best_val) {
+      best_val = val;
+      best_t = t;
+    }
+  }
+  if (best)
+    *best = best_val;
+  return best_t;
+}
+
+// Unit offset across a line walked along (dx, dy) : along its minor axis.
+cv::Point acrossLine(float dx, float dy) {
+  return std::abs(dx) >= std::abs(dy) ? cv::Point(0, 1) : cv::Point(1, 0);
+}
+
+// Walks the pool along (dx, dy) from (x, y) and returns the last step
+// reached before a hole longer than max_gap or the image border. A step is
+// on the line if a pool pixel lies within corridor pixels across it.
+cv::Point walkLine(cv::Mat const &pool, float x, float y, float dx, float dy,
+                   int max_gap, int corridor) {
+  cv::Point across = acrossLine(dx, dy);
+  cv::Point last(cvRound(x), cvRound(y));
+  int gap = 0;
+  while (true) {
+    x += dx;
+    y += dy;
+    cv::Point p(cvRound(x), cvRound(y));
+    if (!withinMat(p.x, p.y, pool.cols, pool.rows))
+      break;
+
+    bool hit = false;
+    for (int o = -corridor; o <= corridor && !hit; ++o) {
+      cv::Point q = p + across * o;
+      hit = withinMat(q.x, q.y, pool.cols, pool.rows) && pool.at<uchar>(q.y, q.x) != REMOVED;
+    }
+    if (hit) {
+      last = p;
+      gap = 0;
+    } else if (++gap > max_gap) {
+      break;
+    }
+  }
+  return last;
+}
+
+// Takes the pixels from p1 to p2, and those within corridor pixels across
+// that path, out of the pool, removing the votes of those which already
+// voted. Returns the number of pixels taken.
+int removeSegment(cv::Mat &pool, cv::Mat &acc, LineSpace const &space,
+                  cv::Point p1, cv::Point p2, int corridor) {
+  int steps = std::max(std::abs(p2.x - p1.x), std::abs(p2.y - p1.y));
+  float dx = steps ? float(p2.x - p1.x) / steps : 0.f;
+  float dy = steps ? float(p2.y - p1.y) / steps : 0.f;
+  cv::Point across = acrossLine(dx, dy);
+  int support = 0;
+  for (int k = 0; k <= steps; ++k) {
+    cv::Point p(cvRound(p1.x + k * dx), cvRound(p1.y + k * dy));
+    for (int o = -corridor; o <= corridor; ++o) {
+      cv::Point q = p + across * o;
+      if (!withinMat(q.x, q.y, pool.cols, pool.rows))
+        continue;
+      uchar &state = pool.at<uchar>(q.y, q.x);
+      if (state == VOTED)
+        voteLinePoint(acc, space, q.x, q.y, -1.f);
+      if (state != REMOVED)
+        ++support;
+      state = REMOVED;
+    }
+  }
+  return support;
+}
+
+// acc holds the votes left once every pixel was processed.
+// If votes isn't null, it receives the number of votes cast.
+std::vector<Segment> progressiveHoughLines(EdgePoints const &pts, cv::Mat &acc,
+                                           LineSpace const &space,
+                                           HoughLinesParams const &params,
+                                           long long *votes = nullptr) {
+  acc = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+
+  cv::Mat pool = cv::Mat::zeros(pts.rows, pts.cols, CV_8UC1);
+  for (int i = 0; i < pts.size(); ++i) {
+    pool.at<uchar>(pts.y[i], pts.x[i]) = PENDING;
+  }
+
+  // Fixed seed : the same frame always gives the same segments.
+  std::vector<int> order(pts.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), std::mt19937(12345));
+
+  std::vector<Segment> segments;
+  long long count = 0;
+  for (int i : order) {
+    int x = pts.x[i];
+    int y = pts.y[i];
+    uchar &state = pool.at<uchar>(y, x);
+    if (state == REMOVED)
+      continue;
+
+    float best;
+    int t = voteLinePoint(acc, space, x, y, 1.f, &best);
+    state = VOTED;
+    count += space.n_theta;
+    if (best < params.votes_thresh)
+      continue;
+
+    // Direction of the line, one pixel along its major axis per step.
+    float theta = space.theta(t);
+    float dx = -sin(theta);
+    float dy = cos(theta);
+    float norm = std::max(std::abs(dx), std::abs(dy));
+    dx /= norm;
+    dy /= norm;
+
+    int corridor = std::max(0, params.corridor);
+    cv::Point p1 = walkLine(pool, x, y, -dx, -dy, params.max_gap, corridor);
+    cv::Point p2 = walkLine(pool, x, y, dx, dy, params.max_gap, corridor);
+
+    float length = std::hypot(p2.x - p1.x, p2.y - p1.y);
+    if (length < params.min_length)
+      continue;
+
+    Segment segment;
+    segment.p1 = p1;
+    segment.p2 = p2;
+    segment.line.theta = theta;
+    segment.line.rho = x * cos(theta) + y * sin(theta);
+    segment.line.position_in_acc = {cvRound(segment.line.rho / space.rho_step) + space.rho_offset, t};
+    segment.support = removeSegment(pool, acc, space, p1, p2, corridor);
+    segments.push_back(segment);
+  }
+
+  if (votes)
+    *votes = count;
+  return segments;
+}
@@ -0,0 +1,195 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+#include "multithreading.hpp"
+
+// Coarse to fine detection
+// 1. the edge points are merged in (2^levels)^2 pixel cells
+// 2. lines / circles are detected on the coarse edge map
+// 3. each candidate is voted again at full resolution, only with the edge
+//    points close to it and in a small neighbourhood of its parameters
+
+// Edge points of the image downsampled by factor : one point per cell
+// containing at least one edge, with the direction of the first of them.
+EdgePoints downsampleEdges(EdgePoints const &pts, int factor) {
+  EdgePoints coarse;
+  coarse.cols = (pts.cols + factor - 1) / factor;
+  coarse.rows = (pts.rows + factor - 1) / factor;
+  coarse.dir_bins = pts.dir_bins;
+
+  cv::Mat seen = cv::Mat::zeros(coarse.rows, coarse.cols, CV_8UC1);
+  for (int i = 0; i < pts.size(); ++i) {
+    int x = pts.x[i] / factor;
+    int y = pts.y[i] / factor;
+    uchar &cell = seen.at<uchar>(y, x);
+    if (cell)
+      continue;
+    cell = 1;
+    coarse.x.push_back(x);
+    coarse.y.push_back(y);
+    if (!pts.dir.empty())
+      coarse.dir.push_back(pts.dir[i]);
+    if (!pts.mag.empty())
+      coarse.mag.push_back(pts.mag[i]);
+  }
+  return coarse;
+}
+
+// Full resolution coordinate of the center of a coarse pixel.
+float upsample(float v, int factor) { return v * factor + (factor - 1) / 2.f; }
+
+// Re-votes a coarse line with the edge points within band pixels of it,
+// over window theta bins and band rho bins on each side.
+Line refineLine(EdgePoints const &pts, Line coarse, LineSpace const &space,
+                int window, float band) {
+  int n_rho = 2 * int(band / space.rho_step) + 1;
+  int n_theta = 2 * window + 1;
+  cv::Mat acc = cv::Mat::zeros(n_theta, n_rho, CV_32F);
+
+  float c0 = cos(coarse.theta);
+  float s0 = sin(coarse.theta);
+
+  // neighbourhood aligned on the bins of the full resolution accumulator
+  float theta_step = radians(space.theta_step);
+  coarse.theta = cvRound(coarse.theta / theta_step) * theta_step;
+  float rho0 = (cvRound(coarse.rho / space.rho_step) - n_rho / 2) * space.rho_step;
+
+  std::vector<float> cos_t(n_theta), sin_t(n_theta);
+  for (int t = 0; t < n_theta; ++t) {
+    cos_t[t] = cos(coarse.theta + (t - window) * theta_step);
+    sin_t[t] = sin(coarse.theta + (t - window) * theta_step);
+  }
+
+  for (int i = 0; i < pts.size(); ++i) {
+    float x = pts.x[i];
+    float y = pts.y[i];
+    if (std::abs(x * c0 + y * s0 - coarse.rho) > band)
+      continue;
+
+    for (int t = 0; t < n_theta; ++t) {
+      int r = cvRound((x * cos_t[t] + y * sin_t[t] - rho0) / space.rho_step);
+      if (r >= 0 && r < n_rho)
+        acc.at<float>(t, r) += 1;
+    }
+  }
+
+  double max;
+  cv::Point best;
+  cv::minMaxLoc(acc, nullptr, &max, nullptr, &best);
+
+  Line line = coarse;
+  if (max > 0) {
+    line.theta = coarse.theta + (best.y - window) * theta_step;
+    line.rho = rho0 + best.x * space.rho_step;
+    line.votes = max;
+  }
+  return line;
+}
+
+// Lines of the full resolution points, detected on a 2^levels downsampled
+// copy then refined. acc receives the coarse accumulator.
+std::vector<Line> pyramidHoughLines(EdgePoints const &pts, cv::Mat &acc,
+                                    int levels, float line_thresh,
+                                    float grouping_thresh, bool use_dirs,
+                                    HoughLinesParams const &params) {
+  int factor = 1 << levels;
+  EdgePoints coarse = downsampleEdges(pts, factor);
+
+  LineSpace coarse_space(coarse.cols, coarse.rows, params);
+  houghLinesMT(params.threads, coarse, acc, coarse_space, use_dirs,
+               std::max(0.f, params.dir_window));
+  auto lines = getLines(acc, coarse_space, line_thresh, grouping_thresh,
+                        params.peak_radius, params.top_k, params.threads);
+
+  // One coarse pixel shifts rho by up to factor pixels, and a short line
+  // drawn on a coarse grid can be off by a few degrees.
+  LineSpace space(pts.cols, pts.rows, params);
+  float band = 2 * factor;
+  int window = std::max(1, int(2 * factor / params.theta_step + 0.5f));
+
+  parallelFor(0, lines.size(), params.threads, [&](int first, int last, int) {
+    for (int l = first; l < last; ++l) {
+      Line &line = lines[l];
+      float shift = (factor - 1) / 2.f * (cos(line.theta) + sin(line.theta));
+      line.rho = line.rho * factor + shift;
+      line = refineLine(pts, line, space, window, band);
+    }
+  });
+
+  return lines;
+}
+
+// Re-votes a coarse circle with the edge points within band pixels of it,
+// for centers and radii within band pixels of the coarse ones.
+Circle refineCircle(EdgePoints const &pts, Circle coarse, int band) {
+  int size = 2 * band + 1;
+  int sizes[]{size, size, size};
+  cv::Mat acc = cv::Mat::zeros(3, sizes, CV_32F);
+
+  for (int i = 0; i < pts.size(); ++i) {
+    float dx = pts.x[i] - coarse.center.x;
+    float dy = pts.y[i] - coarse.center.y;
+    if (std::abs(sqrt(dx * dx + dy * dy) - coarse.radius) > 2 * band)
+      continue;
+
+    for (int b = 0; b < size; ++b) {
+      float db = pts.y[i] - (coarse.center.y + b - band);
+      for (int a = 0; a < size; ++a) {
+        float da = pts.x[i] - (coarse.center.x + a - band);
+        int r = cvRound(sqrt(da * da + db * db)) - coarse.radius + band;
+        if (r >= 0 && r < size)
+          acc.at<float>(b, a, r) += 1;
+      }
+    }
+  }
+
+  Circle circle = coarse;
+  float best = 0;
+  for (int b = 0; b < size; ++b) {
+    for (int a = 0; a < size; ++a) {
+      const float *votes = acc.ptr<float>(b, a);
+      for (int r = 0; r < size; ++r) {
+        if (votes[r] > best) {
+          best = votes[r];
+          circle.center = {coarse.center.x + a - band, coarse.center.y + b - band};
+          circle.radius = coarse.radius + r - band;
+        }
+      }
+    }
+  }
+  return circle;
+}
+
+// Circles of the full resolution points, detected on a 2^levels downsampled
+// copy then refined. Radii are searched in [min_radius, max_radius],
+// max_radius <= 0 meaning as large as the image allows.
+std::vector<Circle> pyramidHoughCircles(EdgePoints const &pts, int levels,
+                                        float circle_thresh,
+                                        float grouping_thresh, bool use_dirs,
+                                        int nb_threads = 0, int min_radius = 1,
+                                        int max_radius = 0) {
+  int factor = 1 << levels;
+  EdgePoints coarse = downsampleEdges(pts, factor);
+
+  cv::Mat acc;
+  int min_r = houghCirclesMT(nb_threads, coarse, acc, use_dirs, std::max(1, min_radius / factor),
+                             max_radius > 0 ? (max_radius + factor - 1) / factor : 0);
+  auto circles = getCircles(acc, circle_thresh, grouping_thresh, min_r, nb_threads);
+
+  parallelFor(0, circles.size(), nb_threads, [&](int first, int last, int) {
+    for (int c = first; c < last; ++c) {
+      Circle &circle = circles[c];
+      circle.center = {cvRound(upsample(circle.center.x, factor)),
+                       cvRound(upsample(circle.center.y, factor))};
+      circle.radius *= factor;
+      circle = refineCircle(pts, circle, factor);
+    }
+  });
+
+  // the coarse range is rounded outwards
+  auto out = [&](Circle const &circle) {
+    return circle.radius < min_radius || (max_radius > 0 && circle.radius > max_radius);
+  };
+  circles.erase(std::remove_if(circles.begin(), circles.end(), out), circles.end());
+  return circles;
+}
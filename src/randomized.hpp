@@ -0,0 +1,198 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+#include <random>
+#include <unordered_map>
+
+// Randomized Hough transform for circles
+// 1. a few edge points are drawn at random : three points, or two points and
+//    their gradient directions, define one circle
+// 2. the circle votes in a hash map of quantized (a, b, r) cells
+// 3. once a cell has min_votes samples, its mean circle is checked against
+//    the edges; if enough of the circumference is there, its points leave
+//    the pool and the map starts again
+// Sampling stops after patience samples without a new circle, or when the
+// iteration budget is spent. Memory only depends on the number of candidates.
+
+struct CircleCell {
+  int votes = 0;
+  float a = 0, b = 0, r = 0; // sums of the sampled parameters
+};
+
+// Circle through three points, false if they are (almost) collinear.
+bool circleFrom3(cv::Point2f p1, cv::Point2f p2, cv::Point2f p3, cv::Point2f &center,
+                 float &radius) {
+  float d = 2 * (p1.x * (p2.y - p3.y) + p2.x * (p3.y - p1.y) + p3.x * (p1.y - p2.y));
+  if (std::abs(d) < 1e-3f)
+    return false;
+  float n1 = p1.dot(p1), n2 = p2.dot(p2), n3 = p3.dot(p3);
+  center.x = (n1 * (p2.y - p3.y) + n2 * (p3.y - p1.y) + n3 * (p1.y - p2.y)) / d;
+  center.y = (n1 * (p3.x - p2.x) + n2 * (p1.x - p3.x) + n3 * (p2.x - p1.x)) / d;
+  cv::Point2f v = p1 - center;
+  radius = std::hypot(v.x, v.y);
+  return true;
+}
+
+// Circle of two points whose gradient lines, of unit directions d1 and d2,
+// cross at the center, false if the lines are (almost) parallel or the
+// points aren't at the same distance of the crossing.
+bool circleFrom2(cv::Point2f p1, cv::Point2f d1, cv::Point2f p2, cv::Point2f d2,
+                 cv::Point2f &center, float &radius) {
+  float cross = d1.x * d2.y - d1.y * d2.x;
+  if (std::abs(cross) < 0.1f)
+    return false;
+  cv::Point2f w = p2 - p1;
+  float t = (w.x * d2.y - w.y * d2.x) / cross;
+  center = p1 + d1 * t;
+  cv::Point2f v1 = p1 - center, v2 = p2 - center;
+  float r1 = std::hypot(v1.x, v1.y), r2 = std::hypot(v2.x, v2.y);
+  radius = (r1 + r2) / 2;
+  return std::abs(r1 - r2) <= 2;
+}
+
+// Pool points within band pixels of the circle, and the part of its
+// circumference they cover (64 angular sectors).
+float circleCoverage(EdgePoints const &pts, std::vector<int> const &pool,
+                     Circle const &circle, std::vector<int> &members, float band = 1) {
+  members.clear();
+  uint64_t seen = 0;
+  for (int i : pool) {
+    float dx = pts.x[i] - circle.center.x;
+    float dy = pts.y[i] - circle.center.y;
+    if (std::abs(std::hypot(dx, dy) - circle.radius) > band)
+      continue;
+    members.push_back(i);
+    int sector = int((atan2(dy, dx) + M_PI) * (64 / (2 * M_PI))) & 63;
+    seen |= uint64_t(1) << sector;
+  }
+  // small circles can't have a pixel in every sector
+  return __builtin_popcountll(seen) / std::min(64.f, float(2 * M_PI * circle.radius));
+}
+
+// Least squares (Kasa) circle through the points members, false if they
+// are (almost) collinear.
+bool fitCircle(EdgePoints const &pts, std::vector<int> const &members, Circle &circle) {
+  int n = members.size();
+  double mx = 0, my = 0;
+  for (int i : members) {
+    mx += pts.x[i];
+    my += pts.y[i];
+  }
+  mx /= n;
+  my /= n;
+
+  double suu = 0, suv = 0, svv = 0, suuu = 0, svvv = 0, suvv = 0, svuu = 0;
+  for (int i : members) {
+    double u = pts.x[i] - mx, v = pts.y[i] - my;
+    suu += u * u;
+    suv += u * v;
+    svv += v * v;
+    suuu += u * u * u;
+    svvv += v * v * v;
+    suvv += u * v * v;
+    svuu += v * u * u;
+  }
+  double det = suu * svv - suv * suv;
+  if (std::abs(det) < 1e-9)
+    return false;
+  double ru = (suuu + suvv) / 2, rv = (svvv + svuu) / 2;
+  double uc = (ru * svv - rv * suv) / det;
+  double vc = (rv * suu - ru * suv) / det;
+  circle.center = {cvRound(uc + mx), cvRound(vc + my)};
+  circle.radius = cvRound(sqrt(uc * uc + vc * vc + (suu + svv) / n));
+  return true;
+}
+
+// Circles of radius in [min_radius, max_radius], max_radius <= 0 meaning as
+// large as the image allows. If samples isn't null, it receives the number
+// of samples drawn.
+std::vector<Circle> randomizedHoughCircles(EdgePoints const &pts, bool use_dirs,
+                                           HoughCirclesParams const &params,
+                                           long long *samples = nullptr) {
+  use_dirs = use_dirs && !pts.dir.empty();
+  int min_r, max_r;
+  circleRange(pts, use_dirs, params.min_radius, params.max_radius, min_r, max_r);
+  int cell = std::max(1, params.cell_size);
+  int needed = use_dirs ? 2 : 3;
+  DirectionBins const &bins = pts.bins();
+  auto unit = [&](int i) {
+    return cv::Point2f(bins.cos_d[pts.dir[i]], bins.sin_d[pts.dir[i]]);
+  };
+
+  // Points still free, and where each of them is in the pool.
+  std::vector<int> pool(pts.size()), where(pts.size());
+  for (int i = 0; i < pts.size(); ++i) {
+    pool[i] = where[i] = i;
+  }
+  auto remove = [&](int i) {
+    int last = pool.back();
+    pool[where[i]] = last;
+    where[last] = where[i];
+    pool.pop_back();
+  };
+
+  // Fixed seed : the same frame always gives the same circles.
+  std::mt19937 rng(12345);
+  std::unordered_map<uint64_t, CircleCell> cells;
+  std::vector<Circle> circles;
+  std::vector<int> members;
+  long long count = 0;
+  int idle = 0;
+  for (; count < params.iterations && idle < params.patience; ++count, ++idle) {
+    if ((int)pool.size() < needed)
+      break;
+
+    int k[3];
+    for (int j = 0; j < needed; ++j) {
+      k[j] = pool[std::uniform_int_distribution<int>(0, pool.size() - 1)(rng)];
+    }
+    if (k[0] == k[1] || (needed == 3 && (k[0] == k[2] || k[1] == k[2])))
+      continue;
+
+    cv::Point2f p[3];
+    for (int j = 0; j < needed; ++j) {
+      p[j] = cv::Point2f(pts.x[k[j]], pts.y[k[j]]);
+    }
+    cv::Point2f center;
+    float radius;
+    bool valid = use_dirs ? circleFrom2(p[0], unit(k[0]), p[1], unit(k[1]), center, radius)
+                          : circleFrom3(p[0], p[1], p[2], center, radius);
+    if (!valid || radius < min_r || radius > max_r ||
+        !withinMat(center.x, center.y, pts.cols, pts.rows))
+      continue;
+
+    uint64_t key = (uint64_t(center.y / cell) << 42) | (uint64_t(center.x / cell) << 21) |
+                   uint64_t(radius / cell);
+    CircleCell &votes = cells[key];
+    votes.votes++;
+    votes.a += center.x;
+    votes.b += center.y;
+    votes.r += radius;
+    if (votes.votes < params.min_votes)
+      continue;
+
+    Circle circle;
+    circle.center = {cvRound(votes.a / votes.votes), cvRound(votes.b / votes.votes)};
+    circle.radius = cvRound(votes.r / votes.votes);
+    if (circleCoverage(pts, pool, circle, members) < params.min_coverage) {
+      cells.erase(key);
+      continue;
+    }
+
+    // Sampled circles are noisy : the circle is fitted on the points found,
+    // and the points of a thick edge all leave the pool.
+    fitCircle(pts, members, circle);
+    circleCoverage(pts, pool, circle, members, 2);
+
+    circles.push_back(circle);
+    for (int i : members) {
+      remove(i);
+    }
+    cells.clear();
+    idle = 0;
+  }
+
+  if (samples)
+    *samples = count;
+  return circles;
+}
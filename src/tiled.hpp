@@ -0,0 +1,346 @@
+#pragma once
+#include "edges.hpp"
+#include "gradient.hpp"
+#include "hough.hpp"
+#include "multithreading.hpp"
+#include "twostage.hpp"
+#include <algorithm>
+#include <functional>
+#include <numeric>
+
+// Tiled edge pipeline
+// The staged path writes full images between its stages (magnitudes,
+// directions, hysteresis map) and reads them back from memory. Here the
+// image is cut in bands of rows small enough for their buffers to stay in
+// L2, read with a halo of rows above and below so that the gradient of the
+// kept rows is the same as on the whole image.
+// 1. each band computes its gradient, labels its pixels > sb with a
+//    union-find (labelRows, as in hysteresisMT) and keeps them as a list of
+//    candidates, the band images are dropped. Strong components are edges :
+//    they are voted at once. Weak ones are dropped, unless they touch the
+//    band borders
+// 2. the components crossing the band borders are merged, a component is an
+//    edge if it holds a pixel > sh : same edges as hysteresis
+// 3. each band votes its weak components that turned out to be edges
+// Bands are spread over the threads in both passes.
+
+const size_t TILE_BYTES = 256 * 1024; // L2 budget of a band
+
+// Bytes per pixel of a band : source, magnitudes, directions, and for the
+// separable kernels both responses and the row pass.
+int tilePixelBytes(int krn) {
+  return kernel::GRADIENT_SIZES[krn] > 3 ? 15 : 3;
+}
+
+// Extra rows read on each side of a band : the kernel radius, plus one for
+// the frame and the non-maximum suppression.
+int tileHalo(int krn) { return kernel::GRADIENT_SIZES[krn] / 2 + 1; }
+
+// Rows per band, band_rows if it is given, else as many as TILE_BYTES holds.
+// On wide images, bands keep at least 4 halos of rows so that the halos
+// recomputed stay below half of the work.
+int tileRows(int cols, int krn, int band_rows = 0) {
+  if (band_rows > 0)
+    return band_rows;
+  int fit = TILE_BYTES / std::max(1, cols * tilePixelBytes(krn));
+  return std::max(4 * tileHalo(krn), fit - 2 * tileHalo(krn));
+}
+
+// Threads of the pipeline, also the number of voter slots.
+int tileThreads(int nb_threads) {
+  return nb_threads <= 0 ? hardwareThreads() : nb_threads;
+}
+
+struct TileStats {
+  int band_rows = 0, bands = 0, edges = 0;
+  size_t peak_bytes = 0; // buffers alive at once, upper bound
+};
+
+// Called with edges of band b on worker w, at most twice per band : the
+// points can be moved out.
+using TileVoter = std::function<void(EdgePoints &pts, int b, int w)>;
+
+// What a band keeps of the rows [y0, y1) once labelled : the weak
+// components touching its borders, whose fate depends on the neighbour bands.
+struct Band {
+  EdgePoints cand;            // pixels of the open weak components, row-major
+  std::vector<int> comp;      // component of each candidate, in the band
+  std::vector<uchar> strong;  // per component : holds a pixel > sh
+  // (column, component) of the pixels > sb of the first and last rows
+  std::vector<std::pair<int, int>> top, bottom;
+  int y0 = 0, y1 = 0;
+  int labelled = 0;           // pixels > sb of the band
+};
+
+// Gradient of the band with its halo, then labels of its pixels > sb. The
+// pixels of strong components are edges whatever the other bands hold :
+// they go to settled. The weak components touching the borders stay in the
+// band, the others are dropped. Components are numbered in row-major order
+// of their first pixel.
+void labelBand(cv::Mat const &src, int krn, uchar sh, uchar sb, Dimension dim,
+               bool thin, int dir_bins, Band &band, EdgePoints &settled) {
+  int rows = src.rows, cols = src.cols;
+  int a = std::max(0, band.y0 - tileHalo(krn));
+  int z = std::min(rows, band.y1 + tileHalo(krn));
+  cv::Mat mags, dirs;
+  gradient(src.rowRange(a, z), krn, mags, dirs, dim, CV_8U, thin, dir_bins);
+
+  EdgePoints &cand = band.cand;
+  for (EdgePoints *pts : {&cand, &settled}) {
+    pts->cols = cols;
+    pts->rows = rows;
+    pts->dir_bins = dir_bins;
+  }
+  std::vector<int> parent;
+  std::vector<uchar> strong;
+  int first = std::max(1, band.y0), last = std::min(rows - 1, band.y1);
+  labelRows(mags, first - a, last - a, sh, sb, parent, strong, [&](int r, int c, int) {
+    cand.x.push_back(c);
+    cand.y.push_back(r + a);
+    cand.dir.push_back(dirs.ptr<uchar>(r)[c]);
+  });
+
+  // roots are the smallest index of their component
+  band.labelled = cand.size();
+  std::vector<uchar> open(cand.size(), 0);
+  for (int i = 0; i < cand.size(); ++i) {
+    parent[i] = findRoot(parent, i);
+    open[parent[i]] |= cand.y[i] == band.y0 || cand.y[i] == band.y1 - 1;
+  }
+  // open components are numbered, strong or not, for the merge
+  std::vector<int> number(cand.size(), -1);
+  int n = 0;
+  for (int i = 0; i < cand.size(); ++i) {
+    int root = parent[i];
+    if (root == i && open[i]) {
+      number[i] = band.strong.size();
+      band.strong.push_back(strong[i]);
+    }
+    if (cand.y[i] == band.y0 && open[root])
+      band.top.push_back({cand.x[i], number[root]});
+    if (cand.y[i] == band.y1 - 1 && open[root])
+      band.bottom.push_back({cand.x[i], number[root]});
+
+    if (strong[root]) {
+      settled.x.push_back(cand.x[i]);
+      settled.y.push_back(cand.y[i]);
+      settled.dir.push_back(cand.dir[i]);
+    } else if (open[root]) {
+      cand.x[n] = cand.x[i];
+      cand.y[n] = cand.y[i];
+      cand.dir[n] = cand.dir[i];
+      band.comp.push_back(number[root]);
+      ++n;
+    }
+  }
+  cand.x.resize(n);
+  cand.y.resize(n);
+  cand.dir.resize(n);
+}
+
+// Marks the points pts in edges, if given.
+void drawTile(EdgePoints const &pts, cv::Mat *edges) {
+  if (!edges)
+    return;
+  for (int i = 0; i < pts.size(); ++i) {
+    edges->at<uchar>(pts.y[i], pts.x[i]) = 255;
+  }
+}
+
+// Edges of src (CV_8UC1) for the kernel krn and the hysteresis thresholds
+// sh / sb, the same as gradient, hysteresis then extractEdges with
+// directions in dir_bins bins, handed to vote band by band. band_rows = 0
+// sizes the bands for TILE_BYTES. If edges is given, it receives the edge map.
+TileStats tiledEdges(cv::Mat const &src, int krn, uchar sh, uchar sb, Dimension dim,
+                     bool thin, int dir_bins, int nb_threads, int band_rows,
+                     TileVoter const &vote, cv::Mat *edges = nullptr) {
+  assert(src.type() == CV_8UC1);
+  assert(dir_bins > 0);
+  int rows = src.rows, cols = src.cols;
+  nb_threads = tileThreads(nb_threads);
+
+  TileStats stats;
+  stats.band_rows = tileRows(cols, krn, band_rows);
+  stats.bands = (rows + stats.band_rows - 1) / stats.band_rows;
+  if (edges)
+    *edges = cv::Mat::zeros(rows, cols, CV_8UC1);
+
+  std::vector<Band> bands(stats.bands);
+  std::vector<int> counts(stats.bands, 0);
+  parallelFor(0, stats.bands, nb_threads, [&](int first, int last, int w) {
+    for (int b = first; b < last; ++b) {
+      bands[b].y0 = b * stats.band_rows;
+      bands[b].y1 = std::min(rows, bands[b].y0 + stats.band_rows);
+      EdgePoints settled;
+      labelBand(src, krn, sh, sb, dim, thin, dir_bins, bands[b], settled);
+      counts[b] = settled.size();
+      drawTile(settled, edges);
+      vote(settled, b, w);
+    }
+  });
+
+  // open components of all the bands, merged across the borders
+  std::vector<int> offset(stats.bands + 1, 0);
+  std::vector<uchar> strong;
+  size_t cand_bytes = 0;
+  int labelled = 0;
+  for (int b = 0; b < stats.bands; ++b) {
+    Band const &band = bands[b];
+    offset[b + 1] = offset[b] + band.strong.size();
+    strong.insert(strong.end(), band.strong.begin(), band.strong.end());
+    cand_bytes += band.cand.size() * (2 * sizeof(int) + 1 + sizeof(int)) +
+                  (band.top.size() + band.bottom.size()) * 2 * sizeof(int);
+    labelled = std::max(labelled, band.labelled);
+  }
+  std::vector<int> parent(offset.back());
+  std::iota(parent.begin(), parent.end(), 0);
+
+  std::vector<int> above(cols + 1, -1);
+  for (int b = 1; b < stats.bands; ++b) {
+    for (auto [x, comp] : bands[b - 1].bottom) {
+      above[x] = offset[b - 1] + comp;
+    }
+    for (auto [x, comp] : bands[b].top) {
+      for (int j = x - 1; j <= x + 1; ++j) {
+        if (above[j] >= 0)
+          unite(parent, strong, offset[b] + comp, above[j]);
+      }
+    }
+    for (auto [x, comp] : bands[b - 1].bottom) {
+      above[x] = -1;
+    }
+  }
+  std::vector<uchar> is_edge(parent.size());
+  for (size_t k = 0; k < parent.size(); ++k) {
+    is_edge[k] = strong[findRoot(parent, k)];
+  }
+
+  parallelFor(0, stats.bands, nb_threads, [&](int first, int last, int w) {
+    for (int b = first; b < last; ++b) {
+      EdgePoints &pts = bands[b].cand;
+      int n = 0;
+      for (int i = 0; i < pts.size(); ++i) {
+        pts.x[n] = pts.x[i];
+        pts.y[n] = pts.y[i];
+        pts.dir[n] = pts.dir[i];
+        n += is_edge[offset[b] + bands[b].comp[i]];
+      }
+      pts.x.resize(n);
+      pts.y.resize(n);
+      pts.dir.resize(n);
+      counts[b] += n;
+      drawTile(pts, edges);
+      if (n > 0)
+        vote(pts, b, w);
+      bands[b] = Band();
+    }
+  });
+
+  for (int n : counts) {
+    stats.edges += n;
+  }
+  int workers = std::min(nb_threads, stats.bands);
+  int band_height = std::min(rows, stats.band_rows + 2 * tileHalo(krn));
+  // a band being labelled also holds all its pixels > sb with their
+  // coordinates, direction, parent, flags and number
+  size_t band_bytes = size_t(band_height) * cols * tilePixelBytes(krn) +
+                      size_t(labelled) * (4 * sizeof(int) + 3);
+  stats.peak_bytes = workers * band_bytes + cand_bytes + parent.size() * (sizeof(int) + 2);
+  return stats;
+}
+
+// Sums the voters' accumulators that were used into acc, zeros of size
+// rows x cols if none was.
+void reduceTiles(std::vector<cv::Mat> &partials, cv::Mat &acc, int rows, int cols,
+                 int nb_threads) {
+  partials.erase(std::remove_if(partials.begin(), partials.end(),
+                                [](cv::Mat const &m) { return m.empty(); }),
+                 partials.end());
+  if (partials.empty()) {
+    acc = cv::Mat::zeros(rows, cols, CV_32F);
+    return;
+  }
+  reduceAccumulators(partials, nb_threads);
+  acc = partials[0];
+}
+
+// Same accumulator as processGradient, extractEdges then houghLinesMT, each
+// band voting in the accumulator of its thread. dir_window as houghLines.
+TileStats tiledHoughLines(cv::Mat const &src, int krn, uchar sh, uchar sb, Dimension dim,
+                          cv::Mat &acc, LineSpace const &space, bool use_dirs,
+                          float dir_window, HoughLinesParams const &params,
+                          cv::Mat *edges = nullptr, int band_rows = 0) {
+  std::vector<cv::Mat> partials(tileThreads(params.threads));
+  int window = windowBins(dir_window, space);
+  TileStats stats = tiledEdges(
+      src, krn, sh, sb, dim, params.thin, params.dir_bins, params.threads, band_rows,
+      [&](EdgePoints &pts, int, int w) {
+        if (partials[w].empty())
+          partials[w] = cv::Mat::zeros(space.n_theta, space.n_rho, CV_32F);
+        if (use_dirs) {
+          voteLinesDirs(partials[w], space, pts.x.data(), pts.y.data(), pts.dir.data(),
+                        pts.bins(), pts.size(), window);
+        } else {
+          voteLines(partials[w], space, pts.x.data(), pts.y.data(), pts.size());
+        }
+      },
+      edges);
+
+  size_t acc_bytes = size_t(space.n_theta) * space.n_rho * sizeof(float);
+  for (auto &partial : partials) {
+    stats.peak_bytes += partial.empty() ? 0 : acc_bytes;
+  }
+  reduceTiles(partials, acc, space.n_theta, space.n_rho, params.threads);
+  return stats;
+}
+
+// Same circles and center accumulator as processGradient, extractEdges then
+// twoStageHoughCircles. The bands vote the centers, their edges are kept
+// for the radius stage, whose histograms don't depend on the order of the
+// points.
+TileStats tiledTwoStageCircles(cv::Mat const &src, int krn, uchar sh, uchar sb,
+                               Dimension dim, cv::Mat &acc, float center_thresh,
+                               HoughCirclesParams const &params,
+                               std::vector<Circle> &circles, cv::Mat *edges = nullptr,
+                               int band_rows = 0) {
+  int rows = src.rows, cols = src.cols;
+  int diag = sqrt(rows * rows + cols * cols);
+  int min_r, max_r;
+  radiusRange(params.min_radius, params.max_radius, diag, min_r, max_r);
+
+  band_rows = tileRows(cols, krn, band_rows);
+  std::vector<EdgePoints> slices((rows + band_rows - 1) / band_rows);
+  std::vector<cv::Mat> partials(tileThreads(params.threads));
+  TileStats stats = tiledEdges(
+      src, krn, sh, sb, dim, params.thin, params.dir_bins, params.threads, band_rows,
+      [&](EdgePoints &pts, int b, int w) {
+        if (partials[w].empty())
+          partials[w] = cv::Mat::zeros(rows, cols, CV_32F);
+        voteCenters(partials[w], pts, 0, pts.size(), min_r, max_r);
+        EdgePoints &slice = slices[b];
+        slice.x.insert(slice.x.end(), pts.x.begin(), pts.x.end());
+        slice.y.insert(slice.y.end(), pts.y.begin(), pts.y.end());
+        slice.dir.insert(slice.dir.end(), pts.dir.begin(), pts.dir.end());
+      },
+      edges);
+
+  for (auto &partial : partials) {
+    stats.peak_bytes += partial.empty() ? 0 : size_t(rows) * cols * sizeof(float);
+  }
+  reduceTiles(partials, acc, rows, cols, params.threads);
+
+  EdgePoints pts;
+  pts.cols = cols;
+  pts.rows = rows;
+  pts.dir_bins = params.dir_bins;
+  for (auto &slice : slices) {
+    pts.x.insert(pts.x.end(), slice.x.begin(), slice.x.end());
+    pts.y.insert(pts.y.end(), slice.y.begin(), slice.y.end());
+    pts.dir.insert(pts.dir.end(), slice.dir.begin(), slice.dir.end());
+    slice = EdgePoints();
+  }
+  stats.peak_bytes += pts.size() * (2 * sizeof(int) + 1);
+
+  circles = centerCircles(pts, acc, center_thresh, min_r, max_r, params);
+  return stats;
+}
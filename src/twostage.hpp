@@ -0,0 +1,154 @@
+#pragma once
+#include "edges.hpp"
+#include "hough.hpp"
+#include "multithreading.hpp"
+
+// Two-stage (2-1) circle detection
+// 1. edge points vote for the centers they may belong to in a 2D image-sized
+//    accumulator, along their gradient line
+// 2. for each center peak, the distances of the edge points to it are
+//    counted in a 1D histogram, whose peaks give the radii
+// A W x H plane and one small histogram per candidate replace the
+// W x H x R cube. Directions are required : without them, each point votes
+// for a whole annulus of centers and the plane has no usable peak.
+
+// Votes the centers of the points [first, last) into acc, along their
+// gradient line on both sides.
+void voteCenters(cv::Mat &acc, EdgePoints const &pts, int first, int last,
+                 int min_r, int max_r) {
+  DirectionBins const &bins = pts.bins();
+  for (int i = first; i < last; ++i) {
+    float c = bins.cos_d[pts.dir[i]];
+    float s = bins.sin_d[pts.dir[i]];
+    for (int dir : {1, -1}) {
+      for (int r = min_r; r <= max_r; ++r) {
+        int a = pts.x[i] + dir * r * c;
+        int b = pts.y[i] + dir * r * s;
+        if (!withinMat(a, b, acc.cols, acc.rows))
+          break;
+        acc.at<float>(b, a) += 1;
+      }
+    }
+  }
+}
+
+// Centers >= thresh which are the maximum of their (2 radius + 1)^2 window.
+// On plateaus, only the first cell in memory order is kept.
+std::vector<cv::Point> centerPeaks(cv::Mat const &acc, float thresh, int radius) {
+  std::vector<cv::Point> peaks;
+  for (int b = 0; b < acc.rows; ++b) {
+    const float *row = acc.ptr<float>(b);
+    for (int a = 0; a < acc.cols; ++a) {
+      float val = row[a];
+      if (val < thresh || val <= 0)
+        continue;
+
+      bool peak = true;
+      for (int db = -radius; db <= radius && peak; ++db) {
+        for (int da = -radius; da <= radius && peak; ++da) {
+          int nb = b + db, na = a + da;
+          if ((!da && !db) || !withinMat(na, nb, acc.cols, acc.rows))
+            continue;
+          float other = acc.at<float>(nb, na);
+          bool before = db < 0 || (db == 0 && da < 0);
+          peak = before ? other < val : other <= val;
+        }
+      }
+      if (peak)
+        peaks.push_back({a, b});
+    }
+  }
+  return peaks;
+}
+
+// Radii of the circles centered on center : peaks of the histogram of the
+// distances of the edge points, kept when edges are seen in at least
+// min_coverage of the directions around the center.
+void centerRadii(EdgePoints const &pts, cv::Point center, int min_r, int max_r,
+                 float min_coverage, std::vector<Circle> &circles) {
+  // One bin of margin on both sides for the 3 bins sums. Each bin also
+  // records which of 64 angular sectors its points fall in : a line through
+  // the center fills a radius bin but only 2 sectors.
+  int size = max_r - min_r + 3;
+  std::vector<int> hist(size, 0);
+  std::vector<uint64_t> sectors(size, 0);
+  int outer = (max_r + 1) * (max_r + 1);
+  for (int i = 0; i < pts.size(); ++i) {
+    int dx = pts.x[i] - center.x;
+    int dy = pts.y[i] - center.y;
+    int d2 = dx * dx + dy * dy;
+    if (d2 >= outer)
+      continue;
+    int r = cvRound(sqrt(float(d2)));
+    if (r < min_r || r > max_r)
+      continue;
+    int k = r - min_r + 1;
+    int sector = int((atan2(float(dy), float(dx)) + M_PI) * (64 / (2 * M_PI))) & 63;
+    ++hist[k];
+    sectors[k] |= uint64_t(1) << sector;
+  }
+
+  // Rasterized circles spread over neighbouring radii : bins are summed by 3.
+  std::vector<int> support(size, 0);
+  for (int k = 1; k + 1 < size; ++k) {
+    support[k] = hist[k - 1] + hist[k] + hist[k + 1];
+  }
+  for (int k = 1; k + 1 < size; ++k) {
+    if (support[k] <= support[k - 1] || support[k] < support[k + 1])
+      continue;
+
+    int r = k - 1 + min_r;
+    uint64_t seen = sectors[k - 1] | sectors[k] | sectors[k + 1];
+    // small circles can't have a pixel in every sector
+    float coverage = __builtin_popcountll(seen) / std::min(64.f, float(2 * M_PI * r));
+    if (coverage >= min_coverage)
+      circles.push_back({center, r});
+  }
+}
+
+// Circles of the centers of acc above center_thresh times the best one, one
+// radius histogram of the points pts per center.
+std::vector<Circle> centerCircles(EdgePoints const &pts, cv::Mat const &acc,
+                                  float center_thresh, int min_r, int max_r,
+                                  HoughCirclesParams const &params) {
+  double max;
+  minmax(acc, nullptr, &max);
+  auto centers = centerPeaks(acc, center_thresh * max, params.peak_radius);
+
+  std::vector<std::vector<Circle>> found(centers.size());
+  parallelFor(0, centers.size(), params.threads, [&](int first, int last, int) {
+    for (int c = first; c < last; ++c) {
+      centerRadii(pts, centers[c], min_r, max_r, params.min_coverage, found[c]);
+    }
+  });
+
+  std::vector<Circle> circles;
+  for (auto &candidates : found) {
+    circles.insert(circles.end(), candidates.begin(), candidates.end());
+  }
+  return circles;
+}
+
+// Circles of radius in [min_radius, max_radius], max_radius <= 0 meaning as
+// large as the image allows. Center peaks must reach center_thresh times the
+// best center. pts must have directions. acc receives the center accumulator.
+std::vector<Circle> twoStageHoughCircles(EdgePoints const &pts, cv::Mat &acc,
+                                         float center_thresh,
+                                         HoughCirclesParams const &params) {
+  assert(!pts.dir.empty());
+  int diag = sqrt(pts.rows * pts.rows + pts.cols * pts.cols);
+  int min_r, max_r;
+  radiusRange(params.min_radius, params.max_radius, diag, min_r, max_r);
+
+  int n = pts.size();
+  int nb_threads = lineWorkers(params.threads, n);
+  std::vector<cv::Mat> partials(nb_threads);
+  parallelFor(0, n, nb_threads, [&](int first, int last, int i) {
+    partials[i] = cv::Mat::zeros(pts.rows, pts.cols, CV_32F);
+    voteCenters(partials[i], pts, first, last, min_r, max_r);
+  });
+  reduceAccumulators(partials, nb_threads);
+  acc = partials[0];
+
+  return centerCircles(pts, acc, center_thresh, min_r, max_r, params);
+}
@@ -8,11 +8,72 @@
 #include <opencv2/core/mat.hpp>
 #include <opencv2/highgui.hpp>
 
+// Filter and gradient settings shared by every demo
+struct GradientControls {
+  int bf_d = 27, bf_sigma_color = 27, bf_sigma_space = 27;
+  int multi_dim = 1, kernel = 2, thin = 0;
+  int sh = 24, sb = 4, bin_thresh = 255;
+  int dir_bins = DIR_BINS;
+
+  Dimension dim() const { return multi_dim ? Dimension::MULTI_DIM : Dimension::TWO_DIM; }
+
+  cv::Mat filter(const cv::Mat &img) const {
+    cv::Mat gray, flt;
+    cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    cv::bilateralFilter(gray, flt, bf_d, bf_sigma_color, bf_sigma_space);
+    return flt;
+  }
+};
+
 class Viewer {
   virtual void process() = 0;
   virtual void configure_window() = 0;
   virtual void window() = 0;
 
+protected:
+  int m_compute = 0;
+
+  // Every trackbar recomputes the result once the compute switch is on
+  void trackbar(const std::string &name, const std::string &w_title, int *value, int count) {
+    cv::createTrackbar(name, w_title, value, count, [](int, void *user) {
+      Viewer *bthis = static_cast<Viewer *>(user);
+      if (bthis->m_compute) {
+        bthis->process();
+      }
+    }, this);
+  }
+
+  void gradientTrackbars(const std::string &w_title, GradientControls &g) {
+    trackbar("[Input] Bilateral filter d", w_title, &g.bf_d, 255);
+    trackbar("[Input] Bilateral filter sigma color", w_title, &g.bf_sigma_color, 255);
+    trackbar("[Input] Bilateral filter sigma space", w_title, &g.bf_sigma_space, 255);
+    trackbar("[Gradient] Bidirectionnal -> 0 | Multidirectionnal -> 1", w_title, &g.multi_dim, 1);
+    trackbar("[Gradient] Kernel (0: prewitt | 1: sobel | 2: kirsch | 3: DoG 5x5 | 4: DoG 7x7)", w_title, &g.kernel, kernel::GRADIENT_COUNT - 1);
+    trackbar("[Gradient] Thin edges (non-maximum suppression)", w_title, &g.thin, 1);
+    trackbar("[Gradient] Direction bins over 360 degrees", w_title, &g.dir_bins, 256);
+    trackbar("[Gradient] Hysteresis : Upper bound (sh)", w_title, &g.sh, 255);
+    trackbar("[Gradient] Hysteresis : Lower bound (sb)", w_title, &g.sb, 255);
+    trackbar("[Hough] Edge detection threshold ", w_title, &g.bin_thresh, 255);
+  }
+
+  // Adds the compute switch, then 'R' computes and escape quits
+  void run(const std::string &w_title) {
+    trackbar("Compute with key 'R'", w_title, &m_compute, 1);
+
+    while (true) {
+      switch (cv::waitKey()) {
+      case 'r':
+        std::cout << "\x1B[2J\x1B[H";
+        std::cout << "Computing..." << std::endl;
+        MEASURE_TIME(this->process());
+        std::cout << "Done." << std::endl;
+        break;
+      case 27:
+        return;
+      }
+    }
+  }
+
 public:
   void show() {
     // process();
@@ -39,12 +100,15 @@ public:
 
 class DemoHoughLinesGrad : public DemoHoughLinesBase {
 private:
-  int m_multi_dim = 1, m_compute = 0, m_invert = 0, m_grad = 1;
-  int m_bin_thresh  = 255, m_line_thresh = 50, m_grouping_thresh = 20;
-  int m_sh = 24, m_sb = 4;
-  int m_canny = 0, m_use_dirs = 1, m_kernel = 2;
+  int m_invert = 0, m_use_grad = 1;
+  int m_line_thresh = 50, m_grouping_thresh = 20;
+  GradientControls m_grad;
+  int m_canny = 0, m_use_dirs = 1, m_tiled = 0;
   int m_thickness = 2;
-  int m_bf_d = 27, m_bf_sigma_color = 27, m_bf_sigma_space = 27;
+  int m_theta_step = 10, m_rho_step = 10;
+  int m_engine = 0, m_votes_thresh = 50, m_min_length = 30, m_max_gap = 5, m_corridor = 2;
+  int m_dir_window = 0, m_segments = 0, m_pyramid = 0;
+  int m_cluster_tolerance = 15, m_min_cluster = 10;
 
 public:
   DemoHoughLinesGrad(const cv::Mat &img) : DemoHoughLinesBase(img) {}
@@ -52,23 +116,39 @@ public:
   void process() override {
     float line_thresh = ((float)this->m_line_thresh) * 0.01;
     float grouping_thresh = ((float)this->m_grouping_thresh) * 0.01;
-    cv::Mat img, gray, flt;
-    if (m_invert && !m_grad)
+    HoughLinesParams params;
+    params.thin = m_grad.thin;
+    params.tiled = m_tiled;
+    params.dir_bins = std::max(4, m_grad.dir_bins);
+    params.theta_step = std::max(1, m_theta_step) * 0.1f;
+    params.rho_step = std::max(1, m_rho_step) * 0.1f;
+    params.engine = static_cast<LineEngine>(m_engine);
+    params.votes_thresh = std::max(1, m_votes_thresh);
+    params.min_length = m_min_length;
+    params.max_gap = m_max_gap;
+    params.corridor = m_corridor;
+    params.segments = m_segments;
+    params.pyramid = m_pyramid;
+    params.dir_window = m_dir_window ? m_dir_window : -1;
+    params.cluster_tolerance = std::max(1, m_cluster_tolerance) * 0.1f;
+    params.min_cluster = std::max(2, m_min_cluster);
+    cv::Mat img;
+    if (m_invert && !m_use_grad)
       cv::bitwise_not(this->m_img, img);
     else
       img = this->m_img;
 
-    cv::cvtColor(m_img, gray, cv::COLOR_BGR2GRAY);
-    cv::bilateralFilter(gray, flt, m_bf_d, m_bf_sigma_color, m_bf_sigma_space);
+    cv::Mat flt = m_grad.filter(m_img);
 
-    if (m_grad) {
+    if (m_use_grad) {
       m_result = houghLinesWithGradient(
-        m_img, flt, m_kernel, m_thickness, m_sh, m_sb, m_bin_thresh, line_thresh, grouping_thresh,
-        m_use_dirs, m_multi_dim ? Dimension::MULTI_DIM : Dimension::TWO_DIM
+        m_img, flt, m_grad.kernel, m_thickness, m_grad.sh, m_grad.sb, m_grad.bin_thresh, line_thresh,
+        grouping_thresh, m_use_dirs, m_grad.dim(), params
       );
     } else {
       m_result = houghLinesFromBin(
-        m_img, flt, img, m_thickness, m_bin_thresh, line_thresh, grouping_thresh, false, m_canny
+        m_img, flt, img, m_thickness, m_grad.bin_thresh, line_thresh, grouping_thresh, false, m_canny,
+        cv::Mat(), params
       );
     }
     window();
@@ -78,58 +158,28 @@ public:
     std::string w_title = "[Configuration panel] Hough Line Detection";
     cv::namedWindow(w_title);
 
-    auto compute_fn = [](int, void *user) {
-      DemoHoughLinesGrad *bthis = static_cast<DemoHoughLinesGrad *>(user);
-      if (bthis->m_compute) {
-        bthis->process();
-      }
-    };
-
-    cv::createTrackbar("[Input] Bilateral filter d", w_title, &m_bf_d, 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Input] Bilateral filter sigma color", w_title, &m_bf_sigma_color, 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Input] Bilateral filter sigma space", w_title, &m_bf_sigma_space, 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Binary] Invert binary image", w_title, &m_invert, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Binary] Opencv edge detection", w_title, &m_canny, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Use gradient ? 0 : no  | 1 : yes ", w_title, &m_grad, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Gradient] 0 : Bidirectionnal | 1 : Multidirectionnal", w_title, &m_multi_dim, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Gradient] Kernel (0: prewitt | 1: sobel | 2: kirsch)", w_title, &m_kernel , 2, compute_fn,
-                       this);
-    cv::createTrackbar("[Gradient] Hysteresis : Upper bound (sh)", w_title, &m_sh, 255, compute_fn,
-                      this);
-    cv::createTrackbar("[Gradient] Hysteresis : Lower bound (sb)", w_title, &m_sb, 255, compute_fn,
-                      this);
-    cv::createTrackbar("[Hough + Gradient] Use direction in computation", w_title, &m_use_dirs, 1, compute_fn,
-                      this);
-    cv::createTrackbar("[Hough] Edge detection threshold ", w_title, &m_bin_thresh , 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Line detection threshold (% of max)", w_title, &m_line_thresh, 100,
-                       compute_fn, this);
-    cv::createTrackbar("[Hough] Grouping threshold (% of max)", w_title, &m_grouping_thresh, 100, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Shape thickness", w_title, &m_thickness, 10, compute_fn,
-                       this);
-    cv::createTrackbar("Compute with key 'R'", w_title,
-                       &m_compute, 1, compute_fn, this);
-
-    while (true) {
-      switch (cv::waitKey()) {
-      case 'r':
-        std::cout << "\x1B[2J\x1B[H";
-        std::cout << "Computing..." << std::endl;
-        MEASURE_TIME(this->process());
-        std::cout << "Done." << std::endl;
-        break;
-      case 27:
-        return;
-      }
-    }
+    gradientTrackbars(w_title, m_grad);
+    trackbar("[Binary] Invert binary image", w_title, &m_invert, 1);
+    trackbar("[Binary] Opencv edge detection", w_title, &m_canny, 1);
+    trackbar("[Hough] Use gradient ? 0 : no  | 1 : yes ", w_title, &m_use_grad, 1);
+    trackbar("[Gradient] Tiled pipeline (exhaustive engine, no pyramid)", w_title, &m_tiled, 1);
+    trackbar("[Hough + Gradient] Use direction in computation", w_title, &m_use_dirs, 1);
+    trackbar("[Hough + Gradient] Direction window (deg, 0: from kernel)", w_title, &m_dir_window, 90);
+    trackbar("[Hough] Theta step (0.1 deg)", w_title, &m_theta_step, 50);
+    trackbar("[Hough] Rho step (0.1 px)", w_title, &m_rho_step, 50);
+    trackbar("[Hough] Engine (0: exhaustive | 1: progressive | 2: kernel)", w_title, &m_engine, 2);
+    trackbar("[Hough] Pyramid levels (0: full resolution)", w_title, &m_pyramid, 3);
+    trackbar("[Hough] Line detection threshold (% of max)", w_title, &m_line_thresh, 100);
+    trackbar("[Hough] Grouping threshold (% of max)", w_title, &m_grouping_thresh, 100);
+    trackbar("[Progressive] Votes threshold", w_title, &m_votes_thresh, 500);
+    trackbar("[Progressive] Corridor half width", w_title, &m_corridor, 10);
+    trackbar("[Kernel] Cluster tolerance (0.1 px)", w_title, &m_cluster_tolerance, 100);
+    trackbar("[Kernel] Min cluster size", w_title, &m_min_cluster, 100);
+    trackbar("[Segments] Split exhaustive lines in segments", w_title, &m_segments, 1);
+    trackbar("[Segments] Min segment length", w_title, &m_min_length, 500);
+    trackbar("[Segments] Max gap", w_title, &m_max_gap, 50);
+    trackbar("[Hough] Shape thickness", w_title, &m_thickness, 10);
+    run(w_title);
   }
 };
 
@@ -145,42 +195,57 @@ public:
     cv::imshow("Input image", m_result.img);
     cv::imshow("Filtered image", m_result.flt);
     cv::imshow("Edges", m_result.edg);
+    if (!m_result.acc.empty())
+      cv::imshow("Accumulator", m_result.acc);
     cv::imshow("Final result", m_result.shapes);
   }
 };
 
 class DemoHoughCirclesGrad : public DemoHoughCirclesBase {
 private:
-  int m_bin_thresh  = 255, m_circle_thresh = 50, m_grouping_thresh = 20;
-  int m_multi_dim = 1, m_compute = 0, m_invert = 0, m_grad = 1;
-  int m_sh = 24, m_sb = 4;
-  int m_canny = 0, m_use_dirs = 1, m_kernel = 2;
+  int m_circle_thresh = 50, m_grouping_thresh = 20;
+  int m_invert = 0, m_use_grad = 1;
+  GradientControls m_grad;
+  int m_canny = 0, m_use_dirs = 1, m_tiled = 0;
   int m_thickness = 2;
-  int m_bf_d = 27, m_bf_sigma_color = 27, m_bf_sigma_space = 27;
+  int m_pyramid = 0;
+  int m_min_radius = 1, m_max_radius = 0;
+  int m_engine = 0, m_min_coverage = 30, m_raster = 0, m_iterations = 20;
 
 public:
   DemoHoughCirclesGrad(const cv::Mat &img) : DemoHoughCirclesBase(img) {}
 
   void process() override {
-    cv::Mat img, gray, flt;
+    cv::Mat img;
     float circle_thresh = this->m_circle_thresh * 0.01;
     float grouping_thresh = this->m_grouping_thresh * 0.01;
-    if (m_invert && !m_grad)
+    HoughCirclesParams params;
+    params.thin = m_grad.thin;
+    params.tiled = m_tiled;
+    params.dir_bins = std::max(4, m_grad.dir_bins);
+    params.pyramid = m_pyramid;
+    params.min_radius = std::max(1, m_min_radius);
+    params.max_radius = m_max_radius;
+    params.engine = static_cast<CircleEngine>(m_engine);
+    params.min_coverage = m_min_coverage * 0.01f;
+    params.voting = m_raster ? RASTER : SWEEP;
+    params.iterations = std::max(1, m_iterations) * 1000;
+    if (m_invert && !m_use_grad)
       cv::bitwise_not(this->m_img, img);
     else
       img = this->m_img;
 
-    cv::cvtColor(m_img, gray, cv::COLOR_BGR2GRAY);
-    cv::bilateralFilter(gray, flt, m_bf_d, m_bf_sigma_color, m_bf_sigma_space);
+    cv::Mat flt = m_grad.filter(m_img);
 
-    if (m_grad) {
+    if (m_use_grad) {
       m_result = houghCirclesWithGradient(
-        img, flt, m_kernel, m_thickness, m_sh, m_sb, m_bin_thresh, circle_thresh, grouping_thresh, 
-        m_use_dirs, m_multi_dim ? Dimension::MULTI_DIM : Dimension::TWO_DIM
+        img, flt, m_grad.kernel, m_thickness, m_grad.sh, m_grad.sb, m_grad.bin_thresh, circle_thresh,
+        grouping_thresh, m_use_dirs, m_grad.dim(), params
       );
     } else {
       m_result = houghCirclesFromBin(
-        m_img, flt, img, m_thickness, m_bin_thresh, circle_thresh, grouping_thresh, false, m_canny
+        m_img, flt, img, m_thickness, m_grad.bin_thresh, circle_thresh, grouping_thresh, false, m_canny,
+        cv::Mat(), params
       );
     }
     window();
@@ -190,58 +255,114 @@ public:
     std::string w_title = "[Configuration panel] Hough Circle Detection";
     cv::namedWindow(w_title);
 
-    auto compute_fn = [](int, void *user) {
-      DemoHoughCirclesGrad *bthis = static_cast<DemoHoughCirclesGrad *>(user);
-      if (bthis->m_compute) {
-        bthis->process();
-      }
-    };
-
-    cv::createTrackbar("[Input] Bilateral filter d", w_title, &m_bf_d, 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Input] Bilateral filter sigma color", w_title, &m_bf_sigma_color, 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Input] Bilateral filter sigma space", w_title, &m_bf_sigma_space, 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Binary] Invert binary image", w_title, &m_invert, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Binary] Opencv edge detection", w_title, &m_canny, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Use gradient ? no -> 0 | yes -> 1 ", w_title, &m_grad, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Gradient] Bidirectionnal -> 0 | Multidirectionnal -> 1", w_title, &m_multi_dim, 1, compute_fn,
-                       this);
-    cv::createTrackbar("[Gradient] Kernel (0: prewitt | 1: sobel | 2: kirsch)", w_title, &m_kernel , 2, compute_fn,
-                       this);
-    cv::createTrackbar("[Gradient] Hysteresis : Upper bound (sb)", w_title, &m_sh, 255, compute_fn,
-                      this);
-    cv::createTrackbar("[Gradient] Hysteresis : Lower bound (sb)", w_title, &m_sb, 255, compute_fn,
-                      this);
-    cv::createTrackbar("[[Hough + Gradient] Use direction in computation", w_title, &m_use_dirs, 1, compute_fn,
-                      this);
-    cv::createTrackbar("[Hough] Edge detection threshold ", w_title, &m_bin_thresh , 255, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Circle detection threshold", w_title, &m_circle_thresh, 100, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Grouping threshold", w_title, &m_grouping_thresh, 100, compute_fn,
-                       this);
-    cv::createTrackbar("[Hough] Shape thickness", w_title, &m_thickness, 10, compute_fn,
-                       this);
-    cv::createTrackbar("Compute with key 'R'", w_title,
-                       &m_compute, 1, compute_fn, this);
+    gradientTrackbars(w_title, m_grad);
+    trackbar("[Binary] Invert binary image", w_title, &m_invert, 1);
+    trackbar("[Binary] Opencv edge detection", w_title, &m_canny, 1);
+    trackbar("[Hough] Use gradient ? no -> 0 | yes -> 1 ", w_title, &m_use_grad, 1);
+    trackbar("[Gradient] Tiled pipeline (two stage engine, with directions)", w_title, &m_tiled, 1);
+    trackbar("[Hough + Gradient] Use direction in computation", w_title, &m_use_dirs, 1);
+    trackbar("[Hough] Pyramid levels (0: full resolution)", w_title, &m_pyramid, 3);
+    trackbar("[Hough] Engine (0: 3D accumulator | 1: two stage, needs directions | 2: randomized)", w_title, &m_engine, 2);
+    trackbar("[Two stage + Randomized] Min circumference coverage (%)", w_title, &m_min_coverage, 100);
+    trackbar("[Randomized] Iterations (x1000)", w_title, &m_iterations, 500);
+    trackbar("[Hough] Voting without directions (0: sweep | 1: raster)", w_title, &m_raster, 1);
+    trackbar("[Hough] Min radius", w_title, &m_min_radius, 1000);
+    trackbar("[Hough] Max radius (0: image size)", w_title, &m_max_radius, 1000);
+    trackbar("[Hough] Circle detection threshold", w_title, &m_circle_thresh, 100);
+    trackbar("[Hough] Grouping threshold", w_title, &m_grouping_thresh, 100);
+    trackbar("[Hough] Shape thickness", w_title, &m_thickness, 10);
+    run(w_title);
+  }
+};
 
-    while (true) {
-      switch (cv::waitKey()) {
-      case 'r':
-        std::cout << "\x1B[2J\x1B[H";
-        std::cout << "Computing..." << std::endl;
-        MEASURE_TIME(this->process());
-        std::cout << "Done." << std::endl;
-        break;
+class DemoHoughEllipsesGrad : public DemoHoughCirclesBase {
+private:
+  int m_center_thresh = 50;
+  GradientControls m_grad;
+  int m_thickness = 2;
+  int m_min_axis = 5, m_max_axis = 0, m_min_coverage = 30;
 
-      case 27:
-        return;
-      }
-    }
+public:
+  DemoHoughEllipsesGrad(const cv::Mat &img) : DemoHoughCirclesBase(img) {}
+
+  void process() override {
+    float center_thresh = this->m_center_thresh * 0.01;
+    HoughEllipsesParams params;
+    params.thin = m_grad.thin;
+    params.dir_bins = std::max(4, m_grad.dir_bins);
+    params.min_axis = std::max(1, m_min_axis);
+    params.max_axis = m_max_axis;
+    params.min_coverage = m_min_coverage * 0.01f;
+
+    m_result = houghEllipsesWithGradient(
+      m_img, m_grad.filter(m_img), m_grad.kernel, m_thickness, m_grad.sh, m_grad.sb, m_grad.bin_thresh,
+      center_thresh, m_grad.dim(), params
+    );
+    window();
+  }
+
+  void configure_window() override {
+    std::string w_title = "[Configuration panel] Hough Ellipse Detection";
+    cv::namedWindow(w_title);
+
+    gradientTrackbars(w_title, m_grad);
+    trackbar("[Hough] Min half axis", w_title, &m_min_axis, 1000);
+    trackbar("[Hough] Max half axis (0: image size)", w_title, &m_max_axis, 1000);
+    trackbar("[Hough] Min circumference coverage (%)", w_title, &m_min_coverage, 100);
+    trackbar("[Hough] Center detection threshold", w_title, &m_center_thresh, 100);
+    trackbar("[Hough] Shape thickness", w_title, &m_thickness, 10);
+    run(w_title);
+  }
+};
+
+class DemoHoughShapesGrad : public DemoHoughCirclesBase {
+private:
+  cv::Mat m_tpl;
+  int m_shape_thresh = 50;
+  GradientControls m_grad;
+  int m_thickness = 2;
+  int m_max_angle = 0, m_angle_step = 10;
+  int m_min_scale = 100, m_max_scale = 100, m_scale_step = 10;
+  int m_cell_size = 2;
+
+public:
+  DemoHoughShapesGrad(const cv::Mat &img, const cv::Mat &tpl)
+      : DemoHoughCirclesBase(img), m_tpl(tpl) {}
+
+  void process() override {
+    float shape_thresh = this->m_shape_thresh * 0.01;
+    HoughShapesParams params;
+    params.thin = m_grad.thin;
+    params.dir_bins = std::max(4, m_grad.dir_bins);
+    params.min_angle = -m_max_angle;
+    params.max_angle = m_max_angle;
+    params.angle_step = std::max(1, m_angle_step);
+    params.min_scale = std::max(10, m_min_scale) * 0.01f;
+    params.max_scale = m_max_scale * 0.01f;
+    params.scale_step = std::max(1, m_scale_step) * 0.01f;
+    params.cell_size = std::max(1, m_cell_size);
+
+    m_result = houghShapesWithGradient(
+      m_img, m_grad.filter(m_img), m_grad.filter(m_tpl), m_grad.kernel, m_thickness, m_grad.sh, m_grad.sb,
+      m_grad.bin_thresh, shape_thresh, m_grad.dim(), params
+    );
+    window();
+  }
+
+  void configure_window() override {
+    std::string w_title = "[Configuration panel] Generalized Hough";
+    cv::namedWindow(w_title);
+    cv::imshow("Template", m_tpl);
+
+    gradientTrackbars(w_title, m_grad);
+    trackbar("[Hough] Rotation range (+/- degrees)", w_title, &m_max_angle, 180);
+    trackbar("[Hough] Rotation step (degrees)", w_title, &m_angle_step, 90);
+    trackbar("[Hough] Min scale (%)", w_title, &m_min_scale, 400);
+    trackbar("[Hough] Max scale (%)", w_title, &m_max_scale, 400);
+    trackbar("[Hough] Scale step (%)", w_title, &m_scale_step, 100);
+    trackbar("[Hough] Accumulator cell size (pixels)", w_title, &m_cell_size, 8);
+    trackbar("[Hough] Shape detection threshold", w_title, &m_shape_thresh, 100);
+    trackbar("[Hough] Shape thickness", w_title, &m_thickness, 10);
+    run(w_title);
   }
 };
@@ -4,6 +4,8 @@
 #include <opencv2/imgproc.hpp>
 
 #include <chrono>
+#include <functional>
+#include <thread>
 
 std::chrono::high_resolution_clock::time_point start;
 std::chrono::high_resolution_clock::time_point stop;
@@ -31,48 +33,6 @@ cv::Mat calcHistCumul(const cv::Mat &src, int histSize) {
   return dst;
 }
 
-cv::Mat etirement(const cv::Mat &image, int Nmin, int Nmax) {
-  int height = image.rows;
-  int width = image.cols;
-  cv::Mat image2(height, width, CV_8UC1);
-  for (int r = 0; r < height; ++r) {
-    for (int c = 0; c < width; ++c) {
-      image2.at<uchar>(r, c) =
-          cv::saturate_cast<uchar>(255 * ((image.at<uchar>(r, c) - Nmin) /
-                                          static_cast<double>(Nmax - Nmin)));
-    }
-  }
-
-  return image2;
-}
-
-cv::Mat egalisation(const cv::Mat &inputImage, const cv::Mat &inputHist,
-                    int histSize) {
-  cv::Mat histoCumul = calcHistCumul(inputHist, histSize);
-
-  histoCumul /= inputImage.total();
-
-  cv::Mat outputImage = inputImage.clone();
-
-  for (int i = 0; i < outputImage.rows; ++i) {
-    for (int j = 0; j < outputImage.cols; ++j) {
-      outputImage.at<uchar>(i, j) = cv::saturate_cast<uchar>(
-          255 * histoCumul.at<float>(inputImage.at<uchar>(i, j)));
-    }
-  }
-  return outputImage;
-}
-
-float convolution(const cv::Mat &img, const cv::Mat &h, int x, int y) {
-  float sum = 0.0;
-  for (int u = -1; u <= 1; ++u) {
-    for (int v = -1; v <= 1; ++v) {
-      sum += h.at<float>(1 + u, 1 + v) * img.at<uchar>(y + u, x + v);
-    }
-  }
-  return sum;
-}
-
 template <typename T> void print_mat(cv::Mat const &mat) {
   for (int r = 0; r < mat.rows; ++r) {
     for (int c = 0; c < mat.cols; ++c) {
@@ -82,38 +42,6 @@ template <typename T> void print_mat(cv::Mat const &mat) {
   }
 }
 
-void filter(const cv::Mat &src, cv::Mat &dst, const cv::Mat &h) {
-  assert(h.rows == 3 && h.cols == 3);
-  int height = src.rows;
-  int width = src.cols;
-  dst = cv::Mat::zeros(src.size(), src.type());
-
-  for (int r = 1; r < height - 1; ++r) {
-    for (int c = 1; c < width - 1; ++c) {
-      dst.at<uchar>(r, c) = cv::saturate_cast<uchar>(convolution(src, h, c, r));
-    }
-  }
-}
-
-void thresholding(cv::Mat const &src, cv::Mat &dst, uchar ths) {
-  assert(src.type() == CV_8UC1);
-  dst = src.clone();
-  int rows = src.rows;
-  int cols = src.cols;
-  for (int r = 1; r < rows - 1; ++r) {
-    for (int c = 1; c < cols - 1; ++c) {
-      uchar val = src.at<uchar>(r, c);
-      // if (val < ths) val = (val - ths*.5 < 0) ? 0 : val - ths*.5;
-      // else val = (val + ths*.5 > 255) ? 255 : val + ths*.5;
-      if (val < ths)
-        val = 0;
-      else
-        val = 255;
-      dst.at<uchar>(r, c) = val;
-    }
-  }
-}
-
 void minmax(const cv::Mat &img, double *min, double *max) {
   cv::Point empty;
   cv::minMaxLoc(img, min, max, &empty, &empty);
@@ -139,3 +67,113 @@ struct TimeFunction {
               << " micro seconds ";
   }
 };
+
+int hardwareThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Splits [begin, end) in nb_threads contiguous chunks and runs
+// func(chunk_begin, chunk_end, thread_index) on each of them in its own thread.
+// nb_threads <= 0 uses one thread per core.
+void parallelFor(int begin, int end, int nb_threads,
+                 std::function<void(int, int, int)> func) {
+  if (nb_threads <= 0)
+    nb_threads = hardwareThreads();
+  nb_threads = std::max(1, std::min(nb_threads, end - begin));
+
+  if (nb_threads == 1) {
+    func(begin, end, 0);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  int size = end - begin;
+  for (int i = 0; i < nb_threads; i++) {
+    int first = begin + (long long)size * i / nb_threads;
+    int last = begin + (long long)size * (i + 1) / nb_threads;
+    threads.push_back(std::thread(func, first, last, i));
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Point operations
+// A pixel only depends on its own value (and the same pixel of a second
+// image) : the per pixel arithmetic is folded in a 256 entry table built
+// once, or in a compare and select. Rows are read through plain pointers so
+// the loops vectorize, and split over nb_threads threads (<= 0 : one per
+// core).
+
+// dst[r][c] = lut[src[r][c]] for the rows [r0, r1).
+void lutRows(const cv::Mat &src, cv::Mat &dst, const uchar *lut, int r0, int r1) {
+  int cols = src.cols;
+  for (int r = r0; r < r1; ++r) {
+    const uchar *in = src.ptr<uchar>(r);
+    uchar *out = dst.ptr<uchar>(r);
+    for (int c = 0; c < cols; ++c) {
+      out[c] = lut[in[c]];
+    }
+  }
+}
+
+// src (CV_8UC1) mapped through lut into dst, src and dst may be the same.
+void applyLUT(const cv::Mat &src, cv::Mat &dst, const uchar *lut, int nb_threads = 0) {
+  assert(src.type() == CV_8UC1);
+  dst.create(src.size(), CV_8UC1);
+  parallelFor(0, src.rows, nb_threads, [&](int first, int last, int) {
+    lutRows(src, dst, lut, first, last);
+  });
+}
+
+// Linear stretch of [Nmin, Nmax] to [0, 255], saturated.
+cv::Mat etirement(const cv::Mat &image, int Nmin, int Nmax, int nb_threads = 0) {
+  uchar lut[256];
+  for (int v = 0; v < 256; ++v) {
+    lut[v] = cv::saturate_cast<uchar>(255 * ((v - Nmin) / static_cast<double>(Nmax - Nmin)));
+  }
+  cv::Mat image2;
+  applyLUT(image, image2, lut, nb_threads);
+  return image2;
+}
+
+// Histogram equalization of inputImage, whose histogram of histSize bins
+// (CV_32F) is inputHist. Values past the last bin map to 255.
+cv::Mat egalisation(const cv::Mat &inputImage, const cv::Mat &inputHist,
+                    int histSize, int nb_threads = 0) {
+  cv::Mat histoCumul = calcHistCumul(inputHist, histSize);
+  double scale = 1.0 / inputImage.total();
+
+  uchar lut[256];
+  for (int v = 0; v < 256; ++v) {
+    float p = v < histSize ? float(histoCumul.at<float>(v) * scale) : 1.f;
+    lut[v] = cv::saturate_cast<uchar>(255 * p);
+  }
+  cv::Mat outputImage;
+  applyLUT(inputImage, outputImage, lut, nb_threads);
+  return outputImage;
+}
+
+// Pixels < ths set to 0, the others to 255. The one pixel frame is copied.
+void thresholding(cv::Mat const &src, cv::Mat &dst, uchar ths, int nb_threads = 0) {
+  assert(src.type() == CV_8UC1);
+  dst.create(src.size(), CV_8UC1);
+  int rows = src.rows;
+  int cols = src.cols;
+  parallelFor(0, rows, nb_threads, [&](int first, int last, int) {
+    for (int r = first; r < last; ++r) {
+      const uchar *in = src.ptr<uchar>(r);
+      uchar *out = dst.ptr<uchar>(r);
+      if (r == 0 || r == rows - 1) {
+        std::copy(in, in + cols, out);
+        continue;
+      }
+      out[0] = in[0];
+      out[cols - 1] = in[cols - 1];
+      for (int c = 1; c < cols - 1; ++c) {
+        out[c] = in[c] < ths ? 0 : 255;
+      }
+    }
+  });
+}